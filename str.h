@@ -4,8 +4,10 @@
 #ifndef STR_H_
 #define STR_H_
 
+#include <float.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <string.h>
 
 #if defined(_MSC_VER) && _MSC_VER < 1700
 typedef __int64 int64_t;
@@ -25,6 +27,25 @@ typedef enum { false = 0, true = 1 } bool;
 #include <stdbool.h>
 #endif
 
+#if defined(__SSE2__) && !defined(STR_NO_SIMD)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__) && !defined(STR_NO_SIMD)
+#include <tmmintrin.h>
+#endif
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(STR_NO_POSIX)
+#define STR_POSIX 1
+#include <errno.h>
+#include <sys/uio.h>
+#endif
+
+// Exact floating point conversions need IEEE 754 binary64 doubles. Where
+// double is shorter, e.g. on AVR, they use plain floating point arithmetic
+#if DBL_MANT_DIG == 53
+#define STR_BINARY64 1
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -35,16 +56,108 @@ extern "C" {
 size_t xvprintf(void (*)(char, void *), void *, const char *, va_list *);
 size_t xprintf(void (*)(char, void *), void *, const char *, ...);
 
+// Same as above, but the output function receives runs of bytes at once
+size_t xvprintfs(void (*)(const char *, size_t, void *), void *, const char *,
+                 va_list *);
+size_t xprintfs(void (*)(const char *, size_t, void *), void *, const char *,
+                ...);
+
+// Precompiled format strings: parse `fmt` once, print many times
+struct xfmt_op {
+  const char *str;       // Literal run: points into the format string
+  size_t len;            // Literal run: length
+  unsigned width, prec;  // Conversion: width and precision, ~0U if not set
+  char conv, pad;        // Conversion: specifier character, padding character
+  char alt, minus;       // Conversion: '#' and '-' flags
+  char lng, star;        // Conversion: number of 'l' modifiers, '.*' is used
+};
+size_t xfmt_compile(const char *fmt, struct xfmt_op *ops, size_t nops);
+size_t xvprintfc(void (*)(char, void *), void *, const struct xfmt_op *,
+                 size_t, va_list *);
+size_t xprintfc(void (*)(char, void *), void *, const struct xfmt_op *, size_t,
+                ...);
+
 // Convenience wrappers around xprintf
 size_t xvsnprintf(char *buf, size_t len, const char *fmt, va_list *ap);
 size_t xsnprintf(char *, size_t, const char *fmt, ...);
 
+// Number printing primitives of the above. xlld() stores a 64-bit integer
+// into `buf`, which must hold 21 bytes, without a NUL, and returns the number
+// of bytes printed. xdtoa() prints like %f or %g with precision `prec`, or
+// the shortest exact form if `fmt` is 0, and NUL-terminates. 25 bytes hold
+// the shortest form and %g with `prec` up to 17, %f needs up to 312 + `prec`.
+// Like xsnprintf(), it returns the full length even if `buf` is too small
+size_t xlld(char *buf, int64_t val, int is_signed, int is_hex);
+#if !defined(NO_FLOAT)
+size_t xdtoa(char *buf, size_t len, double d, int prec, char fmt);
+#endif
+
+// Printing to dynamic memory: a buffer that grows as data is printed.
+// Memory comes from `alloc`, which works like realloc(): it resizes block
+// `ptr` of `oldsize` bytes, allocates a new block if `ptr` is NULL, and frees
+// `ptr` if `size` is 0. It returns NULL on failure
+struct xdbuf {
+  char *buf;         // Buffer, or NULL
+  size_t size, len;  // Buffer size, and the number of bytes printed
+  void *(*alloc)(void *ptr, size_t oldsize, size_t size, void *param);
+  void *param;       // Parameter passed to alloc
+};
+void xdbuf_init(struct xdbuf *db,
+                void *(*alloc)(void *, size_t, size_t, void *), void *param);
+void xout_dbuf(char ch, void *db);
+void xouts_dbuf(const char *buf, size_t len, void *db);
+char *xdbuf_done(struct xdbuf *db);
+void xdbuf_free(struct xdbuf *db);
+
+// Arena allocator for xdbuf: allocates from a fixed buffer, and grows the
+// last allocation in place
+struct xarena {
+  char *buf;
+  size_t size, len;
+};
+void *xarena_alloc(void *ptr, size_t oldsize, size_t size, void *arena);
+
+// Deferred logging. xlog_printf() stores the format string pointer and the
+// raw arguments in a ring buffer, xlog_flush() formats them later. One
+// producer and one consumer can run concurrently without locking
+#define XLOG_REF_STR 1  // Store %s pointers, do not copy strings
+#define XLOG_REF_FMT 2  // Store %M, %m as a function and one pointer argument
+struct xlog {
+  char *buf;                   // Ring buffer
+  size_t size;                 // Buffer size, a multiple of 8
+  volatile size_t head, tail;  // Written by the producer, by the consumer
+  size_t dropped;              // Number of records that did not fit
+  unsigned flags;              // XLOG_REF_* flags
+};
+void xlog_init(struct xlog *log, char *buf, size_t size, unsigned flags);
+bool xlog_printf(struct xlog *log, const char *fmt, ...);
+size_t xlog_flush(struct xlog *log, void (*fn)(char, void *), void *param);
+
+// Resumable printing: capture the arguments once, then print to a sink that
+// can accept only a part of the output, and continue later. The sink returns
+// the number of bytes it has accepted
+struct xprint {
+  char *buf;        // Captured arguments
+  unsigned flags;   // XLOG_REF_* flags
+  const char *fmt;  // Where to continue in the format string
+  size_t ofs;       // Arguments of the next conversion: offset in buf
+  size_t skip;      // Bytes of the next conversion already printed
+};
+bool xprint_start(struct xprint *p, char *buf, size_t size, unsigned flags,
+                  const char *fmt, ...);
+bool xvprint_start(struct xprint *p, char *buf, size_t size, unsigned flags,
+                   const char *fmt, va_list *ap);
+bool xprint_resume(struct xprint *p,
+                   size_t (*fn)(const char *buf, size_t len, void *param),
+                   void *param);
+
 // Pre-defined %M/%m formatting functions
 size_t fmt_ip4(void (*fn)(char, void *), void *arg, va_list *ap);
 size_t fmt_ip6(void (*fn)(char, void *), void *arg, va_list *ap);
 size_t fmt_mac(void (*fn)(char, void *), void *arg, va_list *ap);
 size_t fmt_b64(void (*fn)(char, void *), void *arg, va_list *ap);
 size_t fmt_esc(void (*fn)(char, void *), void *arg, va_list *ap);
+size_t fmt_dbl(void (*fn)(char, void *), void *arg, va_list *ap);
 
 // Utility functions
 struct xstr {
@@ -55,36 +168,247 @@ struct xstr xstr_n(const char *s, size_t n);
 struct xstr xstr_s(const char *s);
 bool xmatch(struct xstr s, struct xstr p, struct xstr *caps);
 void xhexdump(void (*fn)(char, void *), void *arg, const void *buf, size_t len);
+void xhexdump_at(void (*fn)(char, void *), void *arg, const void *buf,
+                 size_t len, size_t addr);
 size_t xb64_decode(const char *src, size_t slen, char *dst, size_t dlen);
+bool xutf8_valid(const char *buf, size_t len);
+
+// Route set: match a string against many xmatch() patterns at once
+struct xroute {
+  struct xstr pattern;  // Pattern, must stay valid while the set is in use
+  int next;             // Next route with the same literal prefix, or -1
+};
+struct xroute_node {
+  int child, sibling;  // First child and next sibling nodes, or -1
+  int routes;          // First route whose literal prefix ends here, or -1
+  int min;             // Smallest route id in this subtree
+  char ch;             // Character that leads to this node
+};
+struct xroutes {
+  struct xroute *routes;     // Caller-provided array of routes
+  struct xroute_node *nodes;  // Caller-provided array of trie nodes
+  int nroutes, maxroutes, nnodes, maxnodes;
+};
+void xroutes_init(struct xroutes *rs, struct xroute *routes, int maxroutes,
+                  struct xroute_node *nodes, int maxnodes);
+int xroutes_add(struct xroutes *rs, struct xstr pattern);
+int xroutes_match(const struct xroutes *rs, struct xstr s, struct xstr *caps);
+
+// Topic index: match a topic against many subscription filters at once
+struct xtopic_node {
+  uint32_t hash;   // Hash of the level that leads to this node
+  int parent;      // Parent node, or -1
+  int bucket;      // First node in the hash bucket with this index, or -1
+  int chain;       // Next node in the same hash bucket, or next free node
+  int plus, multi; // Children for `*` and `#` levels, or -1
+  int nchildren;   // Number of children
+  int subs;        // First subscription whose filter ends here, or -1
+};
+struct xtopic_sub {
+  struct xstr filter;  // Filter, must stay valid while subscribed
+  int id;              // Subscriber id
+  int next;            // Next subscription of the same node, or next free
+};
+struct xtopics {
+  struct xtopic_node *nodes;  // Caller-provided array of nodes
+  struct xtopic_sub *subs;    // Caller-provided array of subscriptions
+  int maxnodes, freenodes, nfree;  // Size, free list head, free nodes count
+  int freesubs;                    // Free subscriptions list head
+};
+void xtopics_init(struct xtopics *t, struct xtopic_node *nodes, int maxnodes,
+                  struct xtopic_sub *subs, int maxsubs);
+int xtopics_add(struct xtopics *t, struct xstr filter, int id);
+int xtopics_del(struct xtopics *t, struct xstr filter, int id);
+int xtopics_match(const struct xtopics *t, struct xstr topic, int *ids,
+                  int maxids);
+
+// Base64 streaming: encode and decode data chunk by chunk
+#define XB64_SKIP_SPACE 1  // Decoder: skip whitespace and newlines
+struct xb64 {
+  uint32_t bits;  // Carried over bits: decoded, or bytes to encode
+  uint8_t n;      // Decoder: characters seen, modulo 4. Encoder: bytes carried
+  uint8_t flags;  // XB64_* flags
+};
+void xb64_init(struct xb64 *ctx, int flags);
+size_t xb64_encode_feed(struct xb64 *ctx, void (*fn)(char, void *),
+                        void *param, const void *buf, size_t len);
+size_t xb64_encode_end(struct xb64 *ctx, void (*fn)(char, void *),
+                       void *param);
+int xb64_decode_feed(struct xb64 *ctx, const char *src, size_t slen,
+                     char *dst, size_t dlen);
+int xb64_decode_end(struct xb64 *ctx);
+
+// Log sinks: every thread prints to its own xsink, and one flusher thread
+// writes out whole lines from all sinks in batches. No locks are taken
+#define XFLUSH_IOV 16  // Maximum number of spans passed to one batch write
+struct xsink {
+  char *buf;               // Ring buffer
+  size_t size;             // Buffer size, a power of 2
+  size_t len, end;         // Bytes printed, and the limit known to be free
+  volatile size_t commit;  // Bytes handed over to the flusher: whole lines
+  volatile size_t done;    // Bytes written out by the flusher
+  size_t dropped;          // Number of lines dropped because the sink was full
+  bool skip;               // Dropping the rest of a line that did not fit
+  volatile size_t closed;  // 1: closed by the owner, 2: removed by flusher
+  struct xsink *next;      // Next sink of the same flusher
+};
+struct xflush {
+  size_t (*fn)(const struct xstr *v, size_t n, void *param);  // Batch write
+  void *param;             // Parameter passed to fn
+  struct xsink *sinks;     // Registered sinks
+  struct xsink *cursor;    // Sink to start the next write from
+  size_t size;             // Write when this many bytes are pending,
+  unsigned long deadline;  // or when this much time passed since last write
+  unsigned long last;      // Time of the last write
+};
+void xflush_init(struct xflush *fl,
+                 size_t (*fn)(const struct xstr *, size_t, void *),
+                 void *param, size_t size, unsigned long deadline);
+void xsink_init(struct xsink *s, struct xflush *fl, char *buf, size_t size);
+void xout_sink(char ch, void *sink);
+void xouts_sink(const char *buf, size_t len, void *sink);
+void xsink_commit(struct xsink *s);
+bool xsink_close(struct xsink *s);
+size_t xflush_poll(struct xflush *fl, unsigned long now);
+#if defined(STR_POSIX)
+size_t xflush_writev(const struct xstr *v, size_t n, void *fd);
+#endif
 
 // JSON parsing API
 int json_get(const char *buf, int len, const char *path, int *size);
+int json_get_many(const char *buf, int len, const char **paths, int n,
+                  int *ofs, int *lens);
+int json_next(const char *buf, int len, int ofs, struct xstr *key,
+              struct xstr *val);
 int json_get_num(const char *buf, int len, const char *path, double *val);
 int json_get_bool(const char *buf, int len, const char *path, int *val);
 long json_get_long(const char *buf, int len, const char *path, long dflt);
+int json_get_i64(const char *buf, int len, const char *path, int64_t *val);
+int json_get_u64(const char *buf, int len, const char *path, uint64_t *val);
 int json_get_str(const char *buf, int len, const char *path, char *dst,
                  size_t dlen);
 int json_get_b64(const char *buf, int len, const char *path, char *dst,
                  size_t dlen);
+int json_get_xstr(const char *buf, int len, const char *path,
+                  struct xstr *val);
+int json_unescape_xstr(struct xstr *str);
+
+// JSON index: parse once, then look up many paths
+struct json_tok {
+  int ofs, len;  // Offset and length of a value or a key in the JSON string
+  int parent;    // Index of the enclosing object or array, or -1
+  int next;      // Index of the token after this one, including its children
+};
+int json_index(const char *buf, int len, struct json_tok *toks, int ntoks);
+int json_index_get(const char *buf, const struct json_tok *toks, int ntoks,
+                   const char *path, int *size);
+
+// JSON streaming parser: feed a document chunk by chunk
+#define JSON_STREAM_DEPTH 20  // Maximum nesting depth
+#define JSON_STREAM_PATH 128  // Maximum length of a path, including NUL
+#define JSON_EV_VALUE 0       // A string, a number, true, false or null
+#define JSON_EV_OPEN 1        // Start of an object or an array
+#define JSON_EV_CLOSE 2       // End of an object or an array
+struct json_stream {
+  void (*fn)(int ev, const char *path, const char *tok, int len, void *param);
+  void *param;  // Parameter passed to fn
+  char *buf;    // Buffer for a token split between chunks
+  int size;     // Buffer size: the longest token that can be split
+  // Parser state. Set by json_stream_init(), do not modify
+  int len;       // Length of a partial token in buf
+  int depth;     // Current depth (nesting level)
+  int plen;      // Length of the current path
+  char expect;   // What is expected next: a value, a key, a colon, etc
+  char tok;      // Type of a partial token, or 0
+  unsigned char nesting[JSON_STREAM_DEPTH];
+  int count[JSON_STREAM_DEPTH];  // Per depth: number of elements seen
+  int base[JSON_STREAM_DEPTH];   // Per depth: path length of the container
+  char path[JSON_STREAM_PATH];   // Path of the current element
+};
+void json_stream_init(struct json_stream *, char *buf, int size,
+                      void (*fn)(int, const char *, const char *, int, void *),
+                      void *param);
+int json_stream_feed(struct json_stream *, const char *buf, int len);
 
 #if !defined(STR_API_ONLY)
-typedef void (*xout_t)(char, void *);                 // Output function
-typedef size_t (*xfmt_t)(xout_t, void *, va_list *);  // %M format function
+typedef void (*xout_t)(char, void *);                    // Output function
+typedef void (*xouts_t)(const char *, size_t, void *);  // Span output function
+typedef size_t (*xfmt_t)(xout_t, void *, va_list *);    // %M format function
 
 struct xbuf {
   char *buf;
   size_t size, len;
 };
 
-static void xout_buf(char ch, void *param) {
+static void xouts_buf(const char *buf, size_t len, void *param) {
   struct xbuf *mb = (struct xbuf *) param;
-  if (mb->len < mb->size) mb->buf[mb->len] = ch;
-  mb->len++;
+  if (mb->len < mb->size) {
+    size_t room = mb->size - mb->len;
+    memcpy(mb->buf + mb->len, buf, len < room ? len : room);
+  }
+  mb->len += len;
+}
+
+static void xout_buf(char ch, void *param) {
+  xouts_buf(&ch, 1, param);
+}
+
+// A span output function wrapped into a per-char xout_t. Everything that
+// prints through xputs() recognises it, and passes whole runs through
+struct xspan {
+  xouts_t fn;
+  void *param;
+};
+
+static void xout_span(char ch, void *param) {
+  struct xspan *s = (struct xspan *) param;
+  s->fn(&ch, 1, s->param);
+}
+
+static size_t xputs(xout_t fn, void *param, const char *buf, size_t len) {
+  size_t i;
+  if (len == 0) {
+  } else if (fn == xout_span) {
+    struct xspan *s = (struct xspan *) param;
+    s->fn(buf, len, s->param);
+  } else if (fn == xout_buf) {
+    xouts_buf(buf, len, param);
+  } else if (fn == xout_dbuf) {
+    xouts_dbuf(buf, len, param);
+  } else if (fn == xout_sink) {
+    xouts_sink(buf, len, param);
+  } else {
+    for (i = 0; i < len; i++) fn(buf[i], param);
+  }
+  return len;
+}
+
+static size_t xpad(xout_t fn, void *param, char pad, size_t len) {
+  const char *s = pad == '0' ? "0000000000000000" : "                ";
+  size_t n = len;
+  for (; n > 16; n -= 16) xputs(fn, param, s, 16);
+  xputs(fn, param, s, n);
+  return len;
+}
+
+size_t xvprintfs(xouts_t fn, void *param, const char *fmt, va_list *ap) {
+  struct xspan span;
+  span.fn = fn, span.param = param;
+  return xvprintf(xout_span, &span, fmt, ap);
+}
+
+size_t xprintfs(xouts_t fn, void *param, const char *fmt, ...) {
+  size_t len = 0;
+  va_list ap;
+  va_start(ap, fmt);
+  len = xvprintfs(fn, param, fmt, &ap);
+  va_end(ap);
+  return len;
 }
 
 size_t xvsnprintf(char *buf, size_t len, const char *fmt, va_list *ap) {
   struct xbuf mb = {buf, len, 0};
-  size_t n = xvprintf(xout_buf, &mb, fmt, ap);
+  size_t n = xvprintfs(xouts_buf, &mb, fmt, ap);
   if (len > 0) buf[n < len ? n : len - 1] = '\0';  // NUL terminate
   return n;
 }
@@ -98,6 +422,82 @@ size_t xsnprintf(char *buf, size_t len, const char *fmt, ...) {
   return n;
 }
 
+void xdbuf_init(struct xdbuf *db,
+                void *(*alloc)(void *, size_t, size_t, void *), void *param) {
+  db->buf = NULL, db->size = db->len = 0, db->alloc = alloc, db->param = param;
+}
+
+// Make room for `len` more bytes, plus a NUL terminator. The buffer doubles,
+// or grows to the exact size if doubling fails. Return false if it cannot
+static bool xdbuf_grow(struct xdbuf *db, size_t len) {
+  size_t need = db->len + len + 1, size = db->size * 2;
+  void *p;
+  if (need <= db->size) return true;
+  if ((db->len > 0 && db->len >= db->size) || need <= len) return false;
+  if (size < need) size = need < 64 ? 64 : need;
+  if ((p = db->alloc(db->buf, db->size, size, db->param)) == NULL) {
+    size = need, p = db->alloc(db->buf, db->size, size, db->param);
+  }
+  if (p != NULL) db->buf = (char *) p, db->size = size;
+  return p != NULL;
+}
+
+void xouts_dbuf(const char *buf, size_t len, void *param) {
+  struct xdbuf *db = (struct xdbuf *) param;
+  if (xdbuf_grow(db, len)) memcpy(db->buf + db->len, buf, len);
+  db->len += len;
+}
+
+void xout_dbuf(char ch, void *param) {
+  struct xdbuf *db = (struct xdbuf *) param;
+  if (db->len + 1 < db->size) {
+    db->buf[db->len++] = ch;  // Fast path: there is room
+  } else {
+    xouts_dbuf(&ch, 1, param);
+  }
+}
+
+// Return the NUL-terminated result, which the caller frees with db->alloc.
+// If memory ran out, free the buffer and return NULL
+char *xdbuf_done(struct xdbuf *db) {
+  char *buf;
+  if (!xdbuf_grow(db, 0)) {
+    xdbuf_free(db);
+    return NULL;
+  }
+  buf = db->buf, buf[db->len] = '\0';
+  db->buf = NULL, db->size = db->len = 0;
+  return buf;
+}
+
+void xdbuf_free(struct xdbuf *db) {
+  if (db->buf != NULL) db->alloc(db->buf, db->size, 0, db->param);
+  db->buf = NULL, db->size = db->len = 0;
+}
+
+void *xarena_alloc(void *ptr, size_t oldsize, size_t size, void *param) {
+  struct xarena *a = (struct xarena *) param;
+  char *p = (char *) ptr;
+  size_t start = ptr == NULL ? (a->len + 7) & ~(size_t) 7 : 0;
+  if (ptr != NULL && p + oldsize == a->buf + a->len) {  // Last allocation
+    if (size <= oldsize || size - oldsize <= a->size - a->len) {
+      a->len = (size_t) (p - a->buf) + size;  // Resize or free in place
+      return size == 0 ? NULL : ptr;
+    }
+    return NULL;
+  } else if (size == 0 || size <= oldsize) {
+    return size == 0 ? NULL : ptr;  // Memory is reclaimed when arena resets
+  } else if (ptr != NULL) {
+    void *q = xarena_alloc(NULL, 0, size, param);
+    if (q != NULL) memcpy(q, ptr, oldsize);
+    return q;
+  } else if (start > a->size || size > a->size - start) {
+    return NULL;
+  }
+  a->len = start + size;
+  return a->buf + start;
+}
+
 size_t fmt_ip4(void (*fn)(char, void *), void *arg, va_list *ap) {
   uint8_t *p = va_arg(*ap, uint8_t *);
   return xprintf(fn, arg, "%d.%d.%d.%d", p[0], p[1], p[2], p[3]);
@@ -127,96 +527,768 @@ static size_t xstrlen(const char *s) {
   return n;
 }
 
-static int addexp(char *buf, int e, int sign) {
-  int n = 0;
-  buf[n++] = 'e';
-  buf[n++] = (char) sign;
-  if (e > 400) return 0;
-  if (e < 10) buf[n++] = '0';
-  if (e >= 100) buf[n++] = (char) (e / 100 + '0'), e -= 100 * (e / 100);
-  if (e >= 10) buf[n++] = (char) (e / 10 + '0'), e -= 10 * (e / 10);
-  buf[n++] = (char) (e + '0');
+// Floating point conversions use 64-bit integer arithmetic with cached
+// powers of ten, and fall back to big integers in rare cases when 64 bits
+// are not precise enough to round correctly
+#define XU64(hi, lo) (((uint64_t) (hi) << 32) | (uint64_t) (lo))
+
+struct xdiyfp {
+  uint64_t f;  // Significand
+  int e;       // Binary exponent: the value is f * 2^e
+};
+
+static const uint64_t xpow10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+    XU64(0x2, 0x540be400), XU64(0x17, 0x4876e800), XU64(0xe8, 0xd4a51000),
+    XU64(0x918, 0x4e72a000), XU64(0x5af3, 0x107a4000),
+    XU64(0x38d7e, 0xa4c68000), XU64(0x2386f2, 0x6fc10000),
+    XU64(0x1634578, 0x5d8a0000), XU64(0xde0b6b3, 0xa7640000),
+    XU64(0x8ac72304, 0x89e80000),
+};
+
+#if defined(STR_BINARY64)
+// Normalised significands and binary exponents of 10^-348, 10^-340, .. 10^340
+static const uint64_t xcpf[] = {
+    XU64(0xfa8fd5a0, 0x081c0288), XU64(0xbaaee17f, 0xa23ebf76),
+    XU64(0x8b16fb20, 0x3055ac76), XU64(0xcf42894a, 0x5dce35ea),
+    XU64(0x9a6bb0aa, 0x55653b2d), XU64(0xe61acf03, 0x3d1a45df),
+    XU64(0xab70fe17, 0xc79ac6ca), XU64(0xff77b1fc, 0xbebcdc4f),
+    XU64(0xbe5691ef, 0x416bd60c), XU64(0x8dd01fad, 0x907ffc3c),
+    XU64(0xd3515c28, 0x31559a83), XU64(0x9d71ac8f, 0xada6c9b5),
+    XU64(0xea9c2277, 0x23ee8bcb), XU64(0xaecc4991, 0x4078536d),
+    XU64(0x823c1279, 0x5db6ce57), XU64(0xc2109436, 0x4dfb5637),
+    XU64(0x9096ea6f, 0x3848984f), XU64(0xd77485cb, 0x25823ac7),
+    XU64(0xa086cfcd, 0x97bf97f4), XU64(0xef340a98, 0x172aace5),
+    XU64(0xb23867fb, 0x2a35b28e), XU64(0x84c8d4df, 0xd2c63f3b),
+    XU64(0xc5dd4427, 0x1ad3cdba), XU64(0x936b9fce, 0xbb25c996),
+    XU64(0xdbac6c24, 0x7d62a584), XU64(0xa3ab6658, 0x0d5fdaf6),
+    XU64(0xf3e2f893, 0xdec3f126), XU64(0xb5b5ada8, 0xaaff80b8),
+    XU64(0x87625f05, 0x6c7c4a8b), XU64(0xc9bcff60, 0x34c13053),
+    XU64(0x964e858c, 0x91ba2655), XU64(0xdff97724, 0x70297ebd),
+    XU64(0xa6dfbd9f, 0xb8e5b88f), XU64(0xf8a95fcf, 0x88747d94),
+    XU64(0xb9447093, 0x8fa89bcf), XU64(0x8a08f0f8, 0xbf0f156b),
+    XU64(0xcdb02555, 0x653131b6), XU64(0x993fe2c6, 0xd07b7fac),
+    XU64(0xe45c10c4, 0x2a2b3b06), XU64(0xaa242499, 0x697392d3),
+    XU64(0xfd87b5f2, 0x8300ca0e), XU64(0xbce50864, 0x92111aeb),
+    XU64(0x8cbccc09, 0x6f5088cc), XU64(0xd1b71758, 0xe219652c),
+    XU64(0x9c400000, 0x00000000), XU64(0xe8d4a510, 0x00000000),
+    XU64(0xad78ebc5, 0xac620000), XU64(0x813f3978, 0xf8940984),
+    XU64(0xc097ce7b, 0xc90715b3), XU64(0x8f7e32ce, 0x7bea5c70),
+    XU64(0xd5d238a4, 0xabe98068), XU64(0x9f4f2726, 0x179a2245),
+    XU64(0xed63a231, 0xd4c4fb27), XU64(0xb0de6538, 0x8cc8ada8),
+    XU64(0x83c7088e, 0x1aab65db), XU64(0xc45d1df9, 0x42711d9a),
+    XU64(0x924d692c, 0xa61be758), XU64(0xda01ee64, 0x1a708dea),
+    XU64(0xa26da399, 0x9aef774a), XU64(0xf209787b, 0xb47d6b85),
+    XU64(0xb454e4a1, 0x79dd1877), XU64(0x865b8692, 0x5b9bc5c2),
+    XU64(0xc83553c5, 0xc8965d3d), XU64(0x952ab45c, 0xfa97a0b3),
+    XU64(0xde469fbd, 0x99a05fe3), XU64(0xa59bc234, 0xdb398c25),
+    XU64(0xf6c69a72, 0xa3989f5c), XU64(0xb7dcbf53, 0x54e9bece),
+    XU64(0x88fcf317, 0xf22241e2), XU64(0xcc20ce9b, 0xd35c78a5),
+    XU64(0x98165af3, 0x7b2153df), XU64(0xe2a0b5dc, 0x971f303a),
+    XU64(0xa8d9d153, 0x5ce3b396), XU64(0xfb9b7cd9, 0xa4a7443c),
+    XU64(0xbb764c4c, 0xa7a44410), XU64(0x8bab8eef, 0xb6409c1a),
+    XU64(0xd01fef10, 0xa657842c), XU64(0x9b10a4e5, 0xe9913129),
+    XU64(0xe7109bfb, 0xa19c0c9d), XU64(0xac2820d9, 0x623bf429),
+    XU64(0x80444b5e, 0x7aa7cf85), XU64(0xbf21e440, 0x03acdd2d),
+    XU64(0x8e679c2f, 0x5e44ff8f), XU64(0xd433179d, 0x9c8cb841),
+    XU64(0x9e19db92, 0xb4e31ba9), XU64(0xeb96bf6e, 0xbadf77d9),
+    XU64(0xaf87023b, 0x9bf0ee6b),
+};
+
+static const short xcpe[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954,
+    -927, -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635,
+    -608, -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316,
+    -289, -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30, 56,
+    83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402, 428, 455,
+    481, 508, 534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800, 827, 853,
+    880, 907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static struct xdiyfp xdiyfp_norm(struct xdiyfp a) {
+  while (!(a.f >> 63)) a.f <<= 1, a.e--;
+  return a;
+}
+
+static struct xdiyfp xdiyfp_mul(struct xdiyfp a, struct xdiyfp b) {
+  uint64_t m = 0xffffffffU, a1 = a.f >> 32, a0 = a.f & m, b1 = b.f >> 32,
+           b0 = b.f & m, x = a1 * b1, y = a0 * b1, z = a1 * b0, w = a0 * b0;
+  uint64_t t = (w >> 32) + (y & m) + (z & m) + XU64(0, 0x80000000);  // Round
+  struct xdiyfp r;
+  r.f = x + (y >> 32) + (z >> 32) + (t >> 32), r.e = a.e + b.e + 64;
+  return r;
+}
+
+// Big integers, used for the exact slow path
+#define XBN_WORDS 40
+struct xbn {
+  uint32_t w[XBN_WORDS];  // Little endian words
+  int n;                  // Number of used words
+};
+
+static void xbn_set(struct xbn *a, uint64_t v) {
+  for (a->n = 0; v > 0; v >>= 32) a->w[a->n++] = (uint32_t) v;
+}
+
+static void xbn_mul(struct xbn *a, uint32_t m) {
+  uint64_t carry = 0;
+  int i;
+  for (i = 0; i < a->n; i++) {
+    carry += (uint64_t) a->w[i] * m;
+    a->w[i] = (uint32_t) carry, carry >>= 32;
+  }
+  if (carry > 0 && a->n < XBN_WORDS) a->w[a->n++] = (uint32_t) carry;
+}
+
+static void xbn_mul10(struct xbn *a, int k) {
+  for (; k >= 9; k -= 9) xbn_mul(a, 1000000000);
+  if (k > 0) xbn_mul(a, (uint32_t) xpow10[k]);
+}
+
+static void xbn_shl(struct xbn *a, int bits) {
+  int i, words = bits / 32, b = bits % 32;
+  uint32_t carry = 0;
+  if (a->n == 0) return;
+  for (i = 0; b > 0 && i < a->n; i++) {
+    uint32_t x = a->w[i];
+    a->w[i] = (x << b) | carry, carry = x >> (32 - b);
+  }
+  if (carry > 0 && a->n < XBN_WORDS) a->w[a->n++] = carry;
+  if (a->n + words > XBN_WORDS) words = XBN_WORDS - a->n;
+  for (i = a->n - 1; words > 0 && i >= 0; i--) a->w[i + words] = a->w[i];
+  for (i = 0; i < words; i++) a->w[i] = 0;
+  a->n += words;
+}
+
+static int xbn_cmp(const struct xbn *a, const struct xbn *b) {
+  int i;
+  if (a->n != b->n) return a->n < b->n ? -1 : 1;
+  for (i = a->n - 1; i >= 0; i--) {
+    if (a->w[i] != b->w[i]) return a->w[i] < b->w[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+static void xbn_sub(struct xbn *a, const struct xbn *b) {  // a >= b
+  uint32_t borrow = 0;
+  int i;
+  for (i = 0; i < a->n; i++) {
+    uint64_t x = (uint64_t) a->w[i] - (i < b->n ? b->w[i] : 0) - borrow;
+    a->w[i] = (uint32_t) x, borrow = (uint32_t) (x >> 63);
+  }
+  while (a->n > 0 && a->w[a->n - 1] == 0) a->n--;
+}
+#endif
+
+#if !defined(NO_FLOAT)
+#define XDTOA_DIGITS 40  // Maximum number of digits produced at once
+
+// Print a character. Printing to a buffer, the common case, is a direct call
+static void xdtoa_c(xout_t fn, void *param, char c) {
+  if (fn == xout_buf) {
+    xout_buf(c, param);
+  } else {
+    fn(c, param);
+  }
+}
+
+static void xdtoa_fixed(xout_t fn, void *param, const char *dig, int n,
+                        int dp, int frac) {
+  int i;
+  if (dp <= 0) xdtoa_c(fn, param, '0');
+  for (i = 0; i < dp; i++) xdtoa_c(fn, param, i < n ? dig[i] : '0');
+  if (frac > 0) xdtoa_c(fn, param, '.');
+  for (i = dp; i < dp + frac; i++) {
+    xdtoa_c(fn, param, i >= 0 && i < n ? dig[i] : '0');
+  }
+}
+
+static void xdtoa_pow(xout_t fn, void *param, int x) {
+  xdtoa_c(fn, param, 'e'), xdtoa_c(fn, param, x < 0 ? '-' : '+');
+  if (x < 0) x = -x;
+  if (x >= 100) xdtoa_c(fn, param, (char) ('0' + x / 100));
+  xdtoa_c(fn, param, (char) ('0' + x / 10 % 10));
+  xdtoa_c(fn, param, (char) ('0' + x % 10));
+}
+
+static void xdtoa_exp(xout_t fn, void *param, const char *dig, int n, int x,
+                      int frac) {
+  int i;
+  xdtoa_c(fn, param, dig[0]);
+  if (frac > 0) xdtoa_c(fn, param, '.');
+  for (i = 1; i <= frac; i++) xdtoa_c(fn, param, i < n ? dig[i] : '0');
+  xdtoa_pow(fn, param, x);
+}
+
+#if defined(STR_BINARY64)
+// Floating point printing. Digits are generated by the Grisu algorithm,
+// F. Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with
+// Integers": a double gets scaled by a cached power of ten using 64-bit
+// integer arithmetic, which takes a constant time. In rare cases when the
+// scaled value is too close to a rounding boundary, digits are computed
+// exactly using big integers
+
+// Return a cached power of ten 10^-k, such that when multiplied by a
+// normalised number with exponent `e`, the exponent lands in [-60, -32]
+static struct xdiyfp xdiyfp_pow10(int e, int *k) {
+  double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int i = (int) dk;
+  struct xdiyfp r;
+  if (dk - i > 0.0) i++;
+  i = (i >> 3) + 1;
+  r.f = xcpf[i], r.e = xcpe[i], *k = 348 - i * 8;
+  return r;
+}
+
+static void xgrisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+                         uint64_t ten_kappa, uint64_t wp_w) {
+  while (rest < wp_w && delta - rest >= ten_kappa &&
+         (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len - 1]--, rest += ten_kappa;
+  }
+}
+
+// Generate the shortest digits of f * 2^e that read back to the same double.
+// Return the number of digits, and store a decimal exponent in `k`
+static int xgrisu_shortest(uint64_t f, int e, char *buf, int *k) {
+  struct xdiyfp v, w, wp, wm, c;
+  uint64_t one, delta, wp_w, p2, rest;
+  uint32_t p1, d;
+  int kappa = 1, len = 0;
+  v.f = f, v.e = e;
+  wp.f = (f << 1) + 1, wp.e = e - 1, wp = xdiyfp_norm(wp);
+  if (f == ((uint64_t) 1 << 52)) {
+    wm.f = (f << 2) - 1, wm.e = e - 2;  // Lower boundary is closer
+  } else {
+    wm.f = (f << 1) - 1, wm.e = e - 1;
+  }
+  wm.f <<= wm.e - wp.e, wm.e = wp.e;
+  c = xdiyfp_pow10(wp.e, k);
+  w = xdiyfp_mul(xdiyfp_norm(v), c);
+  wp = xdiyfp_mul(wp, c), wm = xdiyfp_mul(wm, c);
+  wm.f++, wp.f--;
+  delta = wp.f - wm.f, wp_w = wp.f - w.f, one = (uint64_t) 1 << -wp.e;
+  p1 = (uint32_t) (wp.f >> -wp.e), p2 = wp.f & (one - 1);
+  while (kappa < 10 && p1 >= xpow10[kappa]) kappa++;
+  while (kappa > 0) {
+    d = p1 / (uint32_t) xpow10[kappa - 1], p1 %= (uint32_t) xpow10[kappa - 1];
+    if (d || len) buf[len++] = (char) ('0' + d);
+    kappa--;
+    rest = ((uint64_t) p1 << -wp.e) + p2;
+    if (rest <= delta) {
+      *k += kappa;
+      xgrisu_round(buf, len, delta, rest, xpow10[kappa] << -wp.e, wp_w);
+      return len;
+    }
+  }
+  for (;;) {
+    p2 *= 10, delta *= 10, d = (uint32_t) (p2 >> -wp.e);
+    if (d || len) buf[len++] = (char) ('0' + d);
+    p2 &= one - 1, kappa--;
+    if (p2 < delta) {
+      *k += kappa;
+      xgrisu_round(buf, len, delta, p2, one,
+                   -kappa < 20 ? wp_w * xpow10[-kappa] : 0);
+      return len;
+    }
+  }
+}
+
+// Round up or down the digits in `buf`, given the remainder `rest` in units
+// of the last digit `ten_kappa`, and the error `unit`. Return 0 if too close
+static int xgrisu_weed(char *buf, int len, uint64_t rest, uint64_t ten_kappa,
+                       uint64_t unit, int *kappa) {
+  int i;
+  if (unit >= ten_kappa || ten_kappa - unit <= unit) return 0;
+  if (ten_kappa - rest > rest && ten_kappa - 2 * rest >= 2 * unit) return 1;
+  if (rest > unit && ten_kappa - (rest - unit) <= rest - unit) {
+    buf[len - 1]++;
+    for (i = len - 1; i > 0 && buf[i] == '0' + 10; i--) {
+      buf[i] = '0', buf[i - 1]++;
+    }
+    if (buf[0] == '0' + 10) buf[0] = '1', (*kappa)++;
+    return 1;
+  }
+  return 0;
+}
+
+// Generate `count` correctly rounded digits of a scaled number `w`. Return
+// the number of digits, or 0 if 64-bit precision is not enough to decide
+static int xgrisu_counted(struct xdiyfp w, int count, char *buf, int *kappa) {
+  uint64_t one = (uint64_t) 1 << -w.e, err = 1, frac = w.f & (one - 1), div;
+  uint32_t p1 = (uint32_t) (w.f >> -w.e);
+  int len = 0;
+  for (*kappa = 1; *kappa < 10 && p1 >= xpow10[*kappa];) (*kappa)++;
+  for (div = xpow10[*kappa - 1]; *kappa > 0; div /= 10) {
+    buf[len++] = (char) ('0' + p1 / div), p1 %= (uint32_t) div;
+    (*kappa)--;
+    if (--count == 0) {
+      uint64_t rest = ((uint64_t) p1 << -w.e) + frac;
+      return xgrisu_weed(buf, len, rest, div << -w.e, err, kappa) ? len : 0;
+    }
+  }
+  for (; count > 0 && frac > err; count--) {
+    frac *= 10, err *= 10;
+    buf[len++] = (char) ('0' + (frac >> -w.e));
+    frac &= one - 1, (*kappa)--;
+  }
+  if (count > 0) return 0;
+  return xgrisu_weed(buf, len, frac, one, err, kappa) ? len : 0;
+}
+
+// Store digits of f * 2^e / 10^q rounded half to even into `buf`, which must
+// have space for `max` + 1 digits. Return the number of digits
+static int xdtoa_exact(uint64_t f, int e, int q, char *buf, int max) {
+  struct xbn n, s, t;
+  int i, c, len = 1;
+  xbn_set(&n, f), xbn_set(&s, 1);
+  xbn_shl(e > 0 ? &n : &s, e > 0 ? e : -e);
+  xbn_mul10(q > 0 ? &s : &n, q > 0 ? q : -q);
+  for (t = s, xbn_mul(&t, 10); len < max && xbn_cmp(&n, &t) >= 0; len++) {
+    s = t, xbn_mul(&t, 10);  // Scale s to the most significant digit
+  }
+  for (i = 0; i < len; i++) {
+    buf[i] = '0';
+    if (i > 0) xbn_mul(&n, 10);
+    while (xbn_cmp(&n, &s) >= 0) xbn_sub(&n, &s), buf[i]++;
+  }
+  xbn_shl(&n, 1), c = xbn_cmp(&n, &s);
+  if (c > 0 || (c == 0 && (buf[len - 1] & 1))) {  // Round up
+    for (i = len - 1; i >= 0 && buf[i] == '9'; i--) buf[i] = '0';
+    if (i >= 0) {
+      buf[i]++;
+    } else {
+      buf[0] = '1', buf[len] = '0', len++;  // Carry, e.g. 999 -> 1000
+    }
+  }
+  return len;
+}
+
+// Produce decimal digits of a positive f * 2^e. If `prec` is 0, produce the
+// shortest digits that read back to the same double. Otherwise, round to
+// `prec` significant digits, or to `prec` decimal places if `fixed` is set.
+// At most XDTOA_DIGITS digits are produced, `buf` must hold one more.
+// Return the number of digits, and the decimal point position in `dp`
+static int xdtoa_digits(uint64_t f, int e, int prec, int fixed, char *buf,
+                        int *dp) {
+  struct xdiyfp w;
+  int k, kappa, n, q, count = prec;
+  if (prec == 0 && !fixed) {
+    n = xgrisu_shortest(f, e, buf, &k);
+    *dp = n + k;
+    return n;
+  }
+  w.f = f, w.e = e, w = xdiyfp_norm(w);
+  w = xdiyfp_mul(w, xdiyfp_pow10(w.e, &k));
+  for (n = 1; n < 10 && (w.f >> -w.e) >= xpow10[n];) n++;
+  *dp = n + k;  // Estimation, can be off by one
+  if (fixed) count = *dp + prec;
+  if (count > XDTOA_DIGITS) count = XDTOA_DIGITS, fixed = 0;
+  if (count > 0 && count <= 17 &&
+      (n = xgrisu_counted(w, count, buf, &kappa)) > 0) {
+    *dp = n + k + kappa;
+    return n;
+  }
+  for (q = fixed ? -prec : *dp - count;;) {  // Slow path
+    n = xdtoa_exact(f, e, q, buf, XDTOA_DIGITS);
+    if (fixed || n == count || (n == count + 1 && buf[n - 1] == '0')) break;
+    q += n < count ? -1 : 1;
+  }
+  *dp = n + q;
   return n;
 }
 
-static int xisinf(double x) {
+// Output of more than XDTOA_DIGITS digits. Digits come one by one, and a
+// digit is held back while nines follow it, so that rounding can carry into
+// it. Then they are laid out: the decimal point goes before digit `dp`, and
+// trailing zeros of the fraction are held back too, if they are stripped
+struct xdtoa_out {
+  xout_t fn;
+  void *param;
+  int i, dp;           // Index of the next digit, decimal point position
+  int zeros, nines;    // Zeros and nines held back
+  char pending;        // Digit held back before the nines, or 0
+  char strip, expo;    // Strip trailing zeros, exponent form
+  char carry;          // Rounding has added a leading digit
+};
+
+static void xdtoa_put(struct xdtoa_out *o, char c) {
+  int i;
+  if (o->strip && c == '0' && o->i >= o->dp) {
+    o->zeros++, o->i++;
+    return;
+  }
+  for (i = o->i - o->zeros; i <= o->i; i++) {
+    if (i == o->dp) xdtoa_c(o->fn, o->param, '.');
+    xdtoa_c(o->fn, o->param, i < o->i ? '0' : c);
+  }
+  o->zeros = 0, o->i++;
+}
+
+static void xdtoa_digit(struct xdtoa_out *o, char c) {
+  if (c == '9') {
+    o->nines++;
+    return;
+  }
+  if (o->pending) xdtoa_put(o, o->pending);
+  for (; o->nines > 0; o->nines--) xdtoa_put(o, '9');
+  o->pending = c;
+}
+
+static void xdtoa_round(struct xdtoa_out *o, int up) {
+  if (o->pending) {
+    xdtoa_put(o, (char) (o->pending + up));
+  } else if (up) {
+    o->carry = 1, o->dp += !o->expo;  // All nines: 99.9 -> 100.0
+    xdtoa_put(o, '1');
+  }
+  for (; o->nines > 0; o->nines--) xdtoa_put(o, up ? '0' : '9');
+}
+
+// Scale a positive f * 2^e to n / s in [1, 10). Return the number of digits
+// before the decimal point
+static int xdtoa_scale(uint64_t f, int e, struct xbn *n, struct xbn *s) {
+  struct xbn t;
+  int dp = 1;
+  xbn_set(n, f), xbn_set(s, 1);
+  xbn_shl(e > 0 ? n : s, e > 0 ? e : -e);
+  for (t = *s, xbn_mul(&t, 10); xbn_cmp(n, &t) >= 0; dp++) {
+    *s = t, xbn_mul(&t, 10);
+  }
+  for (; xbn_cmp(n, s) < 0; dp--) xbn_mul(n, 10);
+  return dp;
+}
+
+// Print `count` digits of n / s, rounded half to even
+static void xdtoa_gen(struct xdtoa_out *o, struct xbn *n, const struct xbn *s,
+                      int count) {
+  char d = '0';
+  int i, c;
+  for (i = 0; i < count; i++) {
+    if (i > 0) xbn_mul(n, 10);
+    for (d = '0'; xbn_cmp(n, s) >= 0; d++) xbn_sub(n, s);
+    xdtoa_digit(o, d);
+  }
+  xbn_shl(n, 1), c = xbn_cmp(n, s);
+  xdtoa_round(o, c > 0 || (c == 0 && (d & 1)));
+}
+
+// Print a positive f * 2^e like %f or %g with precision `prec`, when that
+// takes more than XDTOA_DIGITS digits
+static void xdtoa_long(xout_t fn, void *param, uint64_t f, int e, int prec,
+                       char fmt) {
+  struct xdtoa_out o;
+  struct xbn n, s;
+  int dp = xdtoa_scale(f, e, &n, &s), x = dp - 1;
+  memset(&o, 0, sizeof(o));
+  o.fn = fn, o.param = param, o.dp = dp > 0 ? dp : 1, o.strip = fmt == 'g';
+  if (fmt == 'g' && (x < -4 || x >= prec)) {
+    o.dp = 1, o.expo = 1;
+    xdtoa_gen(&o, &n, &s, prec);
+    xdtoa_pow(fn, param, x + o.carry);
+    return;
+  }
+  for (; dp <= 0; dp++) xdtoa_digit(&o, '0');  // 0.00ddd
+  xdtoa_gen(&o, &n, &s, fmt == 'f' ? x + 1 + prec : prec);
+}
+#else
+// Without binary64 doubles, digits of a positive `d` are produced with
+// floating point arithmetic, and the last ones can be off. If `prec` is 0,
+// produce DBL_DIG digits: that many survive a round trip through a double.
+// Otherwise, this works like xdtoa_digits() above
+static int xdtoa_digits(double d, int prec, int fixed, char *buf, int *dp) {
+  double r = 5.0;
+  int i, c, x = 0, count;
+  while (d >= 10.0) d /= 10.0, x++;
+  while (d < 1.0) d *= 10.0, x--;
+  count = fixed ? x + 1 + prec : prec == 0 ? DBL_DIG : prec;
+  if (count > XDTOA_DIGITS) count = XDTOA_DIGITS;
+  if (count >= 0) {
+    for (i = 0; i < count; i++) r /= 10.0;
+    if ((d += r) >= 10.0) d /= 10.0, x++, count += fixed;  // Round
+  }
+  for (i = 0; i < count; i++) {
+    c = (int) d, c = c > 9 ? 9 : c;
+    buf[i] = (char) ('0' + c), d = (d - c) * 10.0;
+  }
+  *dp = x + 1;
+  return count > 0 ? count : 0;
+}
+#endif
+
+// Print double `d` like printf's %f or %g, with precision `prec`. If `fmt`
+// is 0, print the shortest representation that reads back to the same value
+static void xdtoa_to(xout_t fn, void *param, double d, int prec, char fmt) {
+  int p = prec < 1 ? 1 : prec, n, dp, x;
+  char dig[XDTOA_DIGITS + 1];
+  const char *s;
+#if defined(STR_BINARY64)
   union {
     double f;
     uint64_t u;
-  } ieee754 = {x};
-  return ((unsigned) (ieee754.u >> 32) & 0x7fffffff) == 0x7ff00000 &&
-         ((unsigned) ieee754.u == 0);
+  } ieee754 = {d};
+  uint64_t f = ieee754.u & XU64(0xfffff, 0xffffffff);
+  int e = (int) (ieee754.u >> 52) & 0x7ff;
+  if (e == 0x7ff) {
+    s = f ? "nan" : ieee754.u >> 63 ? "-inf" : "inf";
+    while (*s != '\0') xdtoa_c(fn, param, *s++);
+    return;
+  }
+  if (ieee754.u >> 63) xdtoa_c(fn, param, '-');
+  if (e == 0) {
+    e = -1074;  // Subnormal
+  } else {
+    f |= (uint64_t) 1 << 52, e -= 1075;
+  }
+  dp = (int) ((e + 53) * 0.30103) + 1;  // Upper bound for digits before '.'
+  if (f != 0 && fmt == 'f' && dp + prec > XDTOA_DIGITS) {
+    xdtoa_long(fn, param, f, e, prec, fmt);
+    return;
+  } else if (f != 0 && fmt == 'g' && p > XDTOA_DIGITS) {
+    xdtoa_long(fn, param, f, e, p, fmt);
+    return;
+  } else if (f == 0) {
+    dig[0] = '0', n = 1, dp = 1;
+  } else if (fmt == 'f') {
+    n = xdtoa_digits(f, e, prec, 1, dig, &dp);
+  } else {
+    n = xdtoa_digits(f, e, fmt == 'g' ? p : 0, 0, dig, &dp);
+  }
+#else
+  s = d != d ? "nan" : d > DBL_MAX ? "inf" : d < -DBL_MAX ? "-inf" : NULL;
+  if (s != NULL) {
+    while (*s != '\0') xdtoa_c(fn, param, *s++);
+    return;
+  }
+  if (d < 0.0) xdtoa_c(fn, param, '-'), d = -d;
+  if (d == 0.0) {
+    dig[0] = '0', n = 1, dp = 1;
+  } else if (fmt == 'f') {
+    n = xdtoa_digits(d, prec, 1, dig, &dp);
+  } else {
+    n = xdtoa_digits(d, fmt == 'g' ? p : 0, 0, dig, &dp);
+  }
+#endif
+  while (n > 1 && dig[n - 1] == '0' && fmt != 'f') n--;  // Trailing zeroes
+  x = dp - 1;  // Exponent in the scientific notation
+  if (fmt == 'f') {
+    xdtoa_fixed(fn, param, dig, n, dp, prec);
+  } else if (fmt != 'g' && x >= -4 && x < 17) {
+    xdtoa_fixed(fn, param, dig, n, dp, n > dp ? n - dp : 0);
+  } else if (fmt != 'g') {
+    xdtoa_exp(fn, param, dig, n, x, n - 1);
+  } else if (x >= -4 && x < p) {
+    xdtoa_fixed(fn, param, dig, n, dp, n - dp < p - 1 - x ? n - dp : p - 1 - x);
+  } else {
+    xdtoa_exp(fn, param, dig, n, x, n - 1 < p - 1 ? n - 1 : p - 1);
+  }
 }
 
-static int xisnan(double x) {
+// Like xsnprintf(), return the full length even if `dst` is too small
+size_t xdtoa(char *dst, size_t dstlen, double d, int prec, char fmt) {
+  struct xbuf mb = {dst, dstlen, 0};
+  xdtoa_to(xout_buf, &mb, d, prec, fmt);
+  if (dstlen > 0) dst[mb.len < dstlen ? mb.len : dstlen - 1] = '\0';
+  return mb.len;
+}
+
+size_t fmt_dbl(void (*fn)(char, void *), void *param, va_list *ap) {
+  char buf[40];
+  size_t n = xdtoa(buf, sizeof(buf), va_arg(*ap, double), 0, 0);
+  return xputs(fn, param, buf, n);
+}
+#endif
+
+// Load 8 characters into a little endian 64-bit word
+static uint64_t xload8(const char *p) {
+  const unsigned char *s = (const unsigned char *) p;
+  uint32_t lo = (uint32_t) s[0] | (uint32_t) s[1] << 8 |
+                (uint32_t) s[2] << 16 | (uint32_t) s[3] << 24;
+  uint32_t hi = (uint32_t) s[4] | (uint32_t) s[5] << 8 |
+                (uint32_t) s[6] << 16 | (uint32_t) s[7] << 24;
+  return XU64(hi, lo);
+}
+
+// Return non-zero if all 8 characters loaded by xload8() are digits
+static int xisdigit8(uint64_t v) {
+  uint64_t m = XU64(0xf0f0f0f0, 0xf0f0f0f0);
+  return ((v & m) | (((v + XU64(0x06060606, 0x06060606)) & m) >> 4)) ==
+         XU64(0x33333333, 0x33333333);
+}
+
+// Convert 8 digits loaded by xload8() into a number. Adjacent digits are
+// combined in parallel: 8 -> 4 two-digit -> 2 four-digit -> 1 eight-digit
+static uint32_t xparse8(uint64_t v) {
+  uint64_t m = XU64(0xff, 0xff);
+  v -= XU64(0x30303030, 0x30303030);
+  v = v * 10 + (v >> 8);
+  v = ((v & m) * XU64(1000000, 100) + ((v >> 16) & m) * XU64(10000, 1)) >> 32;
+  return (uint32_t) v;
+}
+
+#if defined(STR_BINARY64)
+// Exactly representable powers of ten
+static const double xpow10d[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// Convert f * 2^e to a double. f must have at most 54 significant bits
+static double xdiyfp_dbl(struct xdiyfp w) {
   union {
     double f;
     uint64_t u;
-  } ieee754 = {x};
-  return ((unsigned) (ieee754.u >> 32) & 0x7fffffff) +
-             ((unsigned) ieee754.u != 0) >
-         0x7ff00000;
+  } r;
+  uint64_t hidden = (uint64_t) 1 << 52;
+  while (w.f >= hidden << 1) w.f >>= 1, w.e++;
+  if (w.e >= 972) {
+    r.u = XU64(0x7ff00000, 0);  // Infinity
+  } else if (w.e < -1074 || w.f == 0) {
+    r.u = 0;
+  } else {
+    while (w.e > -1074 && w.f < hidden) w.f <<= 1, w.e--;
+    r.u = (w.f & (hidden - 1)) |
+          (uint64_t) (w.f < hidden ? 0 : w.e + 1075) << 52;  // Subnormal?
+  }
+  return r.f;
 }
 
-static size_t xdtoa(char *dst, size_t dstlen, double d, int width, int tz) {
-  char buf[40];
-  int i, s = 0, n = 0, e = 0;
-  double t, mul, saved;
-  if (d == 0.0) return xsnprintf(dst, dstlen, "%s", "0");
-  if (xisinf(d)) return xsnprintf(dst, dstlen, "%s", d > 0 ? "inf" : "-inf");
-  if (xisnan(d)) return xsnprintf(dst, dstlen, "%s", "nan");
-  if (d < 0.0) d = -d, buf[s++] = '-';
-
-  // Round
-  saved = d;
-  mul = 1.0;
-  while (d >= 10.0 && d / mul >= 10.0) mul *= 10.0;
-  while (d <= 1.0 && d / mul <= 1.0) mul /= 10.0;
-  for (i = 0, t = mul * 5; i < width; i++) t /= 10.0;
-  d += t;
-  // Calculate exponent, and 'mul' for scientific representation
-  mul = 1.0;
-  while (d >= 10.0 && d / mul >= 10.0) mul *= 10.0, e++;
-  while (d < 1.0 && d / mul < 1.0) mul /= 10.0, e--;
-  // printf(" --> %g %d %g %g\n", saved, e, t, mul);
-
-  if (e >= width && width > 1) {
-    n = (int) xdtoa(buf, sizeof(buf), saved / mul, width, tz);
-    // printf(" --> %.*g %d [%.*s]\n", 10, d / t, e, n, buf);
-    n += addexp(buf + s + n, e, '+');
-    return xsnprintf(dst, dstlen, "%.*s", n, buf);
-  } else if (e <= -width && width > 1) {
-    n = (int) xdtoa(buf, sizeof(buf), saved / mul, width, tz);
-    // printf(" --> %.*g %d [%.*s]\n", 10, d / mul, e, n, buf);
-    n += addexp(buf + s + n, -e, '-');
-    return xsnprintf(dst, dstlen, "%.*s", n, buf);
+// Convert m * 10^q to a double, where m has `nd` digits, followed by
+// non-zero digits that were cut off if `trunc` is set. The product with a
+// cached power of ten is computed in 64 bits and rounded to the double
+// precision. Return 0 if the rounding error might have flipped the result
+// that is stored in `d`: then it is the lower of two candidates
+static int xatod_diyfp(uint64_t m, int nd, int q, int trunc, double *d) {
+  struct xdiyfp w, c;
+  uint64_t err = trunc ? 8 : 0, bits, half;  // Error is in 1/8 of a unit
+  int i = (q + 348) / 8, adj = q + 348 - i * 8, e, n;
+  w.f = m, w.e = 0, w = xdiyfp_norm(w), err <<= -w.e;
+  if (adj > 0) {
+    c.f = xpow10[adj], c.e = 0, c = xdiyfp_norm(c);
+    w = xdiyfp_mul(w, c);
+    if (nd + adj > 18) err += 4;  // Product does not fit in 63 bits
+  }
+  c.f = xcpf[i], c.e = xcpe[i];
+  w = xdiyfp_mul(w, c);
+  err += err > 0 ? 9 : 8;  // Error of the cached power and of the product
+  e = w.e, w = xdiyfp_norm(w), err <<= e - w.e;
+  e = 64 + w.e;                                              // Magnitude
+  n = 64 - (e >= -1021 ? 53 : e <= -1074 ? 0 : e + 1074);  // Extra bits
+  if (n + 3 >= 64) {  // Tiny subnormal, make room to scale by 8
+    int shift = n + 3 - 63;
+    w.f >>= shift, w.e += shift, err = (err >> shift) + 9, n -= shift;
+  }
+  bits = (w.f & (((uint64_t) 1 << n) - 1)) * 8;
+  half = ((uint64_t) 1 << (n - 1)) * 8;
+  w.f >>= n, w.e += n;
+  if (bits >= half + err) w.f++;
+  *d = xdiyfp_dbl(w);
+  return bits <= half - err || bits >= half + err;
+}
+
+// Compare the decimal number 0.ddd, whose digits are in `p`, with the
+// midpoint between a positive double `d` and the next one, scaled by 10^-k.
+// Digits of the midpoint are produced one by one, so that inputs of any
+// length are compared exactly
+static int xatod_cmp(const char *p, int len, int k, double d) {
+  union {
+    double f;
+    uint64_t u;
+  } ieee754 = {d};
+  uint64_t f = ieee754.u & XU64(0xfffff, 0xffffffff);
+  int i, digit, e = (int) (ieee754.u >> 52), lead = 1;
+  struct xbn n, s;
+  if (e == 0) {
+    e = -1074;  // Subnormal
   } else {
-    for (i = 0, t = mul; t >= 1.0 && s + n < (int) sizeof(buf); i++) {
-      int ch = (int) (d / t);
-      if (n > 0 || ch > 0) buf[s + n++] = (char) (ch + '0');
-      d -= ch * t;
-      t /= 10.0;
-    }
-    // printf(" --> [%g] -> %g %g (%d) [%.*s]\n", saved, d, t, n, s + n, buf);
-    if (n == 0) buf[s++] = '0';
-    while (t >= 1.0 && n + s < (int) sizeof(buf)) buf[n++] = '0', t /= 10.0;
-    if (s + n < (int) sizeof(buf)) buf[n + s++] = '.';
-    // printf(" 1--> [%g] -> [%.*s]\n", saved, s + n, buf);
-    for (i = 0, t = 0.1; s + n < (int) sizeof(buf) && n < width; i++) {
-      int ch = (int) (d / t);
-      buf[s + n++] = (char) (ch + '0');
-      d -= ch * t;
-      t /= 10.0;
-    }
-  }
-  while (tz && n > 0 && buf[s + n - 1] == '0') n--;  // Trim trailing zeroes
-  if (n > 0 && buf[s + n - 1] == '.') n--;           // Trim trailing dot
-  n += s;
-  if (n >= (int) sizeof(buf)) n = (int) sizeof(buf) - 1;
-  buf[n] = '\0';
-  return xsnprintf(dst, dstlen, "%s", buf);
+    f |= (uint64_t) 1 << 52, e -= 1075;
+  }
+  xbn_set(&n, 2 * f + 1), xbn_set(&s, 1);
+  xbn_shl(e > 0 ? &n : &s, e > 0 ? e - 1 : 1 - e);
+  xbn_mul10(k > 0 ? &s : &n, k > 0 ? k : -k);
+  if (xbn_cmp(&n, &s) >= 0) return -1;  // Midpoint is not below 10^k
+  for (i = 0; i < len && (xisdigit(p[i]) || p[i] == '.'); i++) {
+    if (p[i] == '.' || (lead && p[i] == '0')) continue;
+    xbn_mul(&n, 10), lead = 0;
+    for (digit = 0; xbn_cmp(&n, &s) >= 0; digit++) xbn_sub(&n, &s);
+    if (p[i] - '0' != digit) return p[i] - '0' < digit ? -1 : 1;
+  }
+  return n.n > 0 ? -1 : 0;
+}
+
+// Parse a decimal number and round it to the nearest double. Digits are
+// consumed 8 at a time, the first 19 significant ones are accumulated in
+// 64 bits. Numbers that fit into 53 bits and have a small exponent are
+// converted by a single floating point operation, others are scaled in
+// 64-bit integer arithmetic. Big integers resolve the rare cases when that
+// is not precise enough, using all digits
+static double xatod(const char *p, int len, int *numlen) {
+  union {
+    double f;
+    uint64_t u;
+  } r;
+  uint64_t m = 0, v;
+  int i = 0, nd = 1, q = 0, x = 0, c, trunc = 0, neg = 0, eneg = 0, start;
+
+  if (i < len && (p[i] == '-' || p[i] == '+')) neg = p[i++] == '-';
+  start = i;
+
+  // Decimal
+  while (i + 8 <= len && m < xpow10[11] && xisdigit8(v = xload8(&p[i]))) {
+    m = m * 100000000 + xparse8(v), i += 8;
+  }
+  for (; i < len && xisdigit(p[i]); i++) {
+    if (m < xpow10[18]) {
+      m = m * 10 + (uint64_t) (p[i] - '0');
+    } else {
+      q++, trunc |= p[i] != '0';
+    }
+  }
+
+  // Fractional
+  if (i < len && p[i] == '.') {
+    for (i++; i + 8 <= len && m < xpow10[11] && xisdigit8(v = xload8(&p[i]));
+         i += 8) {
+      m = m * 100000000 + xparse8(v), q -= 8;
+    }
+    for (; i < len && xisdigit(p[i]); i++) {
+      if (m < xpow10[18]) {
+        m = m * 10 + (uint64_t) (p[i] - '0'), q--;
+      } else {
+        trunc |= p[i] != '0';
+      }
+    }
+  }
+
+  // Exponential
+  if (i < len && (p[i] == 'e' || p[i] == 'E')) {
+    i++;
+    if (i < len && (p[i] == '-' || p[i] == '+')) eneg = p[i++] == '-';
+    for (; i < len && xisdigit(p[i]); i++) {
+      if (x < 1000) x = x * 10 + p[i] - '0';  // Fits a 16-bit int
+    }
+    q += eneg ? -x : x;
+  }
+  if (numlen != NULL) *numlen = i;
+
+  while (nd < 19 && m >= xpow10[nd]) nd++;
+  if (m == 0 || nd + q < -324) {
+    r.u = 0;
+  } else if (nd + q > 310) {
+    r.u = XU64(0x7ff00000, 0);  // Infinity
+  } else if (!trunc && m <= XU64(0x200000, 0) && q >= -22 && q <= 22) {
+    r.f = q < 0 ? (double) m / xpow10d[-q] : (double) m * xpow10d[q];
+  } else if (!xatod_diyfp(m, nd, q, trunc, &r.f) &&
+             r.u < XU64(0x7ff00000, 0)) {
+    c = xatod_cmp(&p[start], len - start, nd + q, r.f);
+    if (c > 0 || (c == 0 && (r.u & 1))) r.u++;
+  }
+  if (neg) r.u |= XU64(0x80000000, 0);
+  return r.f;
 }
 
+#else
+// Without binary64 doubles, accumulate digits with floating point arithmetic
 static double xatod(const char *p, int len, int *numlen) {
   double d = 0.0;
   int i = 0, sign = 1;
@@ -262,75 +1334,270 @@ static double xatod(const char *p, int len, int *numlen) {
   if (numlen != NULL) *numlen = i;
   return d;
 }
+#endif
+
+// Return the length of a number at `p`, as parsed by xatod()
+static int json_pass_number(const char *p, int len) {
+  int i = 0;
+  if (i < len && (p[i] == '-' || p[i] == '+')) i++;
+  while (i + 8 <= len && xisdigit8(xload8(&p[i]))) i += 8;
+  while (i < len && xisdigit(p[i])) i++;
+  if (i < len && p[i] == '.') {
+    for (i++; i + 8 <= len && xisdigit8(xload8(&p[i]));) i += 8;
+    while (i < len && xisdigit(p[i])) i++;
+  }
+  if (i < len && (p[i] == 'e' || p[i] == 'E')) {
+    i++;
+    if (i < len && (p[i] == '-' || p[i] == '+')) i++;
+    while (i < len && xisdigit(p[i])) i++;
+  }
+  return i;
+}
+
+// Parse `n` decimal digits into `v`. Return 0 on overflow or a non-digit
+static int xatou(const char *p, int n, uint64_t *v) {
+  uint64_t x = 0, y, max = XU64(0x19999999, 0x99999999);  // UINT64_MAX / 10
+  int i = 0;
+  while (i + 8 <= n && x < xpow10[11] && xisdigit8(y = xload8(&p[i]))) {
+    x = x * 100000000 + xparse8(y), i += 8;
+  }
+  for (; i < n; i++) {
+    if (!xisdigit(p[i]) || x > max || (x == max && p[i] > '5')) return 0;
+    x = x * 10 + (uint64_t) (p[i] - '0');
+  }
+  *v = x;
+  return n > 0;
+}
+
+static const char xdigits2[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Return the number of decimal digits in `v`
+static size_t xdigits32(uint32_t v) {
+  size_t n = 1;
+  for (;;) {
+    if (v < 10) return n;
+    if (v < 100) return n + 1;
+    if (v < 1000) return n + 2;
+    if (v < 10000) return n + 3;
+    v /= 10000, n += 4;
+  }
+}
+
+// Store `n` decimal digits of `v` into `buf`, two digits at a time
+static void xutoa32(char *buf, size_t n, uint32_t v) {
+  while (v >= 100) {
+    uint32_t i = v % 100 * 2;
+    v /= 100, buf[--n] = xdigits2[i + 1], buf[--n] = xdigits2[i];
+  }
+  if (v >= 10) {
+    buf[1] = xdigits2[v * 2 + 1], buf[0] = xdigits2[v * 2];
+  } else {
+    buf[0] = (char) ('0' + v);
+  }
+}
+
+// Store exactly 8 decimal digits of `v` < 10^8 into `buf`, with leading zeros
+static void xutoa8(char *buf, uint32_t v) {
+  int i;
+  for (i = 6; i >= 0; i -= 2) {
+    uint32_t d = v % 100 * 2;
+    v /= 100, buf[i] = xdigits2[d], buf[i + 1] = xdigits2[d + 1];
+  }
+}
 
-static size_t xlld(char *buf, int64_t val, int is_signed, int is_hex) {
+// Print a number into `buf`. Digits are counted first, and then stored at
+// their final positions. 64-bit numbers are split into 8-digit groups by at
+// most two 64-bit divisions, and the rest is done in 32-bit arithmetic
+size_t xlld(char *buf, int64_t val, int is_signed, int is_hex) {
   const char *letters = "0123456789abcdef";
   uint64_t v = (uint64_t) val;
   size_t s = 0, n, i;
-  if (is_signed && val < 0) buf[s++] = '-', v = (uint64_t) (-val);
-  // This loop prints a number in reverse order. I guess this is because we
-  // write numbers from right to left: least significant digit comes last.
-  // Maybe because we use Arabic numbers, and Arabs write RTL?
+  if (is_signed && val < 0) buf[s++] = '-', v = 0 - v;
   if (is_hex) {
-    for (n = 0; v; v >>= 4) buf[s + n++] = letters[v & 15];
+    uint32_t t = (uint32_t) v;
+    n = 1;
+    if ((v >> 32) != 0) t = (uint32_t) (v >> 32), n += 8;
+    if ((t >> 16) != 0) t >>= 16, n += 4;
+    if ((t >> 8) != 0) t >>= 8, n += 2;
+    if ((t >> 4) != 0) n++;
+    for (i = n; i > 1; v >>= 8) {
+      buf[s + --i] = letters[v & 15], buf[s + --i] = letters[(v >> 4) & 15];
+    }
+    if (i > 0) buf[s] = letters[v & 15];
+  } else if ((v >> 32) == 0) {
+    n = xdigits32((uint32_t) v);
+    xutoa32(buf + s, n, (uint32_t) v);
   } else {
-    for (n = 0; v; v /= 10) buf[s + n++] = letters[v % 10];
-  }
-  // Reverse a string
-  for (i = 0; i < n / 2; i++) {
-    char t = buf[s + i];
-    buf[s + i] = buf[s + n - i - 1], buf[s + n - i - 1] = t;
+    uint64_t q = v / 100000000;
+    uint32_t lo = (uint32_t) (v - q * 100000000), mid = 0;
+    size_t groups = 1;
+    if ((q >> 32) != 0) {
+      uint64_t q2 = q / 100000000;
+      mid = (uint32_t) (q - q2 * 100000000), q = q2, groups = 2;
+    }
+    n = xdigits32((uint32_t) q) + groups * 8;
+    xutoa32(buf + s, n - groups * 8, (uint32_t) q);
+    if (groups == 2) xutoa8(buf + s + n - 16, mid);
+    xutoa8(buf + s + n - 8, lo);
   }
-  if (val == 0) buf[n++] = '0';  // Handle special case
   return n + s;
 }
 
 static size_t scpy(void (*o)(char, void *), void *ptr, char *buf, size_t len) {
   size_t i = 0;
-  while (i < len && buf[i] != '\0') o(buf[i++], ptr);
-  return i;
+  while (i < len && buf[i] != '\0') i++;
+  return xputs(o, ptr, buf, i);
 }
 
-static char xesc(int c, int esc) {
-  const char *p, *esc1 = "\b\f\n\r\t\\\"", *esc2 = "bfnrt\\\"";
-  for (p = esc ? esc1 : esc2; *p != '\0'; p++) {
-    if (*p == c) return esc ? esc2[p - esc1] : esc1[p - esc2];
+// Set the high bit of every non-zero byte in `v`
+static uint64_t xnonzero(uint64_t v) {
+  uint64_t m = XU64(0x7f7f7f7f, 0x7f7f7f7f);
+  return ((v & m) + m) | v;
+}
+
+// Escape for every byte: 0 if none, or a character that follows backslash.
+// Control characters without a short escape are printed as \u00XX
+static const char xesc_map[256] =
+    "uuuuuuuubtnufruuuuuuuuuuuuuuuuuu\0\0\"\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\\";
+
+// Return the offset of the first byte in `s` starting from `i` that must
+// be escaped, or `len`. Control characters include NUL, which ends `s`
+static size_t xesc_pass(const char *s, size_t i, size_t len) {
+  uint64_t v, h = XU64(0x80808080, 0x80808080);
+#if defined(__SSE2__) && !defined(STR_NO_SIMD)
+  __m128i q = _mm_set1_epi8('"'), b = _mm_set1_epi8('\\'),
+          c = _mm_set1_epi8(0x1f);
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (s + i));
+    int m = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(x, q), _mm_cmpeq_epi8(x, b)),
+        _mm_cmpeq_epi8(_mm_min_epu8(x, c), x)));  // x <= 0x1f
+    if (m != 0) return i + (size_t) __builtin_ctz((unsigned) m);
   }
-  return 0;
+#endif
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&v, s + i, sizeof(v));
+    if ((((v - XU64(0x20202020, 0x20202020)) & ~v) |  // A byte below 0x20
+         ~xnonzero(v ^ XU64(0x22222222, 0x22222222)) |
+         ~xnonzero(v ^ XU64(0x5c5c5c5c, 0x5c5c5c5c))) &
+        h) {
+      break;
+    }
+  }
+  while (i < len && xesc_map[(uint8_t) s[i]] == 0) i++;
+  return i;
 }
 
 size_t fmt_esc(void (*fn)(char, void *), void *param, va_list *ap) {
   unsigned len = va_arg(*ap, unsigned);
   const char *s = va_arg(*ap, const char *);
-  size_t i, n = 0;
+  size_t i, k = 0, n = 0;  // k is a start of the unescaped run
   if (len == 0) len = s == NULL ? 0 : (unsigned) xstrlen(s);
-  for (i = 0; i < len && s[i] != '\0'; i++) {
-    char c = xesc(s[i], 1);
-    if (c) {
-      fn('\\', param), fn(c, param), n += 2;
-    } else {
-      fn(s[i], param);
-      n++;
-    }
+  for (i = xesc_pass(s, 0, len); i < len && s[i] != '\0';
+       i = xesc_pass(s, i + 1, len)) {
+    uint8_t c = (uint8_t) s[i];
+    char tmp[6] = {'\\', 'u', '0', '0', 0, 0};
+    tmp[1] = xesc_map[c];
+    tmp[4] = "0123456789abcdef"[c >> 4], tmp[5] = "0123456789abcdef"[c & 15];
+    n += xputs(fn, param, s + k, i - k);
+    n += xputs(fn, param, tmp, tmp[1] == 'u' ? 6 : 2);
+    k = i + 1;
+  }
+  n += xputs(fn, param, s + k, i - k);
+  return n;
+}
+
+static const char xb64_map[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Encode `n` bytes from `p` into `buf`. `n` must be a multiple of 3. With
+// SSSE3, encode 12 bytes at a time
+static size_t xb64_encode(const uint8_t *p, size_t n, char *buf) {
+  size_t i = 0, j = 0;
+#if defined(__SSSE3__) && !defined(STR_NO_SIMD)
+  const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                      '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                      '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                      '/' - 63, 'A', 0, 0);
+  for (; i + 16 <= n; i += 12, j += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (p + i)), r;
+    // Spread 3 bytes over 4 bytes, then move 6-bit values into place
+    x = _mm_shuffle_epi8(x, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7,
+                                          10, 9, 11, 10));
+    x = _mm_or_si128(
+        _mm_mulhi_epu16(_mm_and_si128(x, _mm_set1_epi32(0x0fc0fc00)),
+                        _mm_set1_epi32(0x04000040)),
+        _mm_mullo_epi16(_mm_and_si128(x, _mm_set1_epi32(0x003f03f0)),
+                        _mm_set1_epi32(0x01000010)));
+    // Map 0..25 to 13, 26..51 to 0, 52..61 to 1..10, 62 to 11, 63 to 12,
+    // and add a per-range offset from the `shift` table
+    r = _mm_or_si128(_mm_subs_epu8(x, _mm_set1_epi8(51)),
+                     _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), x),
+                                   _mm_set1_epi8(13)));
+    x = _mm_add_epi8(x, _mm_shuffle_epi8(shift, r));
+    _mm_storeu_si128((__m128i *) (buf + j), x);
+  }
+#endif
+  for (; i + 3 <= n; i += 3, j += 4) {
+    uint32_t v = (uint32_t) p[i] << 16 | (uint32_t) p[i + 1] << 8 | p[i + 2];
+    buf[j] = xb64_map[v >> 18], buf[j + 1] = xb64_map[(v >> 12) & 63];
+    buf[j + 2] = xb64_map[(v >> 6) & 63], buf[j + 3] = xb64_map[v & 63];
+  }
+  return j;
+}
+
+void xb64_init(struct xb64 *ctx, int flags) {
+  ctx->bits = 0, ctx->n = 0, ctx->flags = (uint8_t) flags;
+}
+
+size_t xb64_encode_feed(struct xb64 *ctx, void (*fn)(char, void *),
+                        void *param, const void *buf, size_t len) {
+  const uint8_t *p = (const uint8_t *) buf;
+  size_t i = 0, k, n = 0;
+  char tmp[128];  // Encode in chunks, print each chunk at once
+  while (ctx->n > 0 && ctx->n < 3 && i < len) {
+    ctx->bits = ctx->bits << 8 | p[i++], ctx->n++;
+  }
+  if (ctx->n == 3) {
+    uint8_t b[3];
+    b[0] = (uint8_t) (ctx->bits >> 16), b[1] = (uint8_t) (ctx->bits >> 8);
+    b[2] = (uint8_t) ctx->bits, ctx->bits = 0, ctx->n = 0;
+    n += xputs(fn, param, tmp, xb64_encode(b, 3, tmp));
+  }
+  for (; i + 3 <= len; i += k) {
+    k = len - i < sizeof(tmp) / 4 * 3 ? (len - i) / 3 * 3 : sizeof(tmp) / 4 * 3;
+    n += xputs(fn, param, tmp, xb64_encode(p + i, k, tmp));
   }
+  for (; i < len; i++) ctx->bits = ctx->bits << 8 | p[i], ctx->n++;
   return n;
 }
 
+size_t xb64_encode_end(struct xb64 *ctx, void (*fn)(char, void *),
+                       void *param) {
+  uint32_t v = ctx->bits << (ctx->n == 1 ? 16 : 8);
+  char tmp[4];
+  if (ctx->n == 0) return 0;
+  tmp[0] = xb64_map[v >> 18], tmp[1] = xb64_map[(v >> 12) & 63];
+  tmp[2] = ctx->n == 2 ? xb64_map[(v >> 6) & 63] : '=', tmp[3] = '=';
+  ctx->bits = 0, ctx->n = 0;
+  return xputs(fn, param, tmp, 4);
+}
+
 size_t fmt_b64(void (*fn)(char, void *), void *param, va_list *ap) {
   unsigned len = va_arg(*ap, unsigned);
   uint8_t *buf = va_arg(*ap, uint8_t *);
-  size_t i, n = 0;
-  const char *t =
-      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-  for (i = 0; i < len; i += 3) {
-    uint8_t c1 = buf[i], c2 = i + 1 < len ? buf[i + 1] : 0,
-            c3 = i + 2 < len ? buf[i + 2] : 0;
-    char tmp[4] = {t[c1 >> 2], t[(c1 & 3) << 4 | (c2 >> 4)], '=', '='};
-    if (i + 1 < len) tmp[2] = t[(c2 & 15) << 2 | (c3 >> 6)];
-    if (i + 2 < len) tmp[3] = t[c3 & 63];
-    n += scpy(fn, param, tmp, sizeof(tmp));
-  }
-  return n;
+  struct xb64 ctx;
+  size_t n;
+  xb64_init(&ctx, 0);
+  n = xb64_encode_feed(&ctx, fn, param, buf, len);
+  return n + xb64_encode_end(&ctx, fn, param);
 }
 
 size_t xprintf(void (*fn)(char, void *), void *ptr, const char *fmt, ...) {
@@ -342,95 +1609,611 @@ size_t xprintf(void (*fn)(char, void *), void *ptr, const char *fmt, ...) {
   return len;
 }
 
-size_t xvprintf(xout_t fn, void *param, const char *fmt, va_list *ap) {
-  size_t i = 0, n = 0;
-  while (fmt[i] != '\0') {
-    if (fmt[i] == '%') {
-      size_t j, k, x = 0, is_long = 0, w = 0 /* width */, pr = ~0U /* prec */;
-      char pad = ' ', minus = 0, c = fmt[++i];
-      if (c == '#') x++, c = fmt[++i];
-      if (c == '-') minus++, c = fmt[++i];
-      if (c == '0') pad = '0', c = fmt[++i];
-      while (xisdigit(c)) w *= 10, w += (size_t) (c - '0'), c = fmt[++i];
-      if (c == '.') {
-        c = fmt[++i];
-        if (c == '*') {
-          pr = (size_t) va_arg(*ap, int);
-          c = fmt[++i];
-        } else {
-          pr = 0;
-          while (xisdigit(c)) pr *= 10, pr += (size_t) (c - '0'), c = fmt[++i];
-        }
+// Parse either a run of literal characters, or a single conversion
+// specification at `fmt` into `op`. Return the rest of the format string
+static const char *xfmt_parse(const char *fmt, struct xfmt_op *op) {
+  size_t i = 0;
+  char c;
+  memset(op, 0, sizeof(*op));
+  if (fmt[0] != '%') {
+    while (fmt[i] != '\0' && fmt[i] != '%') i++;
+    op->str = fmt, op->len = i;
+    return fmt + i;
+  }
+  op->pad = ' ', op->prec = ~0U, c = fmt[++i];
+  if (c == '#') op->alt++, c = fmt[++i];
+  if (c == '-') op->minus++, c = fmt[++i];
+  if (c == '0') op->pad = '0', c = fmt[++i];
+  while (xisdigit(c)) {
+    op->width *= 10, op->width += (unsigned) (c - '0'), c = fmt[++i];
+  }
+  if (c == '.') {
+    c = fmt[++i];
+    if (c == '*') {
+      op->star = 1, c = fmt[++i];
+    } else {
+      op->prec = 0;
+      while (xisdigit(c)) {
+        op->prec *= 10, op->prec += (unsigned) (c - '0'), c = fmt[++i];
       }
-      while (c == 'h') c = fmt[++i];  // Treat h and hh as int
-      if (c == 'l') {
-        is_long++, c = fmt[++i];
-        if (c == 'l') is_long++, c = fmt[++i];
+    }
+  }
+  while (c == 'h') c = fmt[++i];  // Treat h and hh as int
+  if (c == 'l') {
+    op->lng++, c = fmt[++i];
+    if (c == 'l') op->lng++, c = fmt[++i];
+  }
+  if (c == 'p') op->alt = 1, op->lng = 1;
+  op->conv = c;
+  return c == '\0' ? &fmt[i] : &fmt[i + 1];  // Do not run past the end
+}
+
+// Print a literal run, or a conversion fetching its arguments from `ap`
+static size_t xfmt_exec(xout_t fn, void *param, const struct xfmt_op *op,
+                        va_list *ap) {
+  size_t j, k, n = 0, w = op->width, pr = op->prec;
+  char pad = op->pad, minus = op->minus, c = op->conv;
+  if (op->str != NULL) return xputs(fn, param, op->str, op->len);
+  if (op->star) pr = (size_t) va_arg(*ap, int);
+  if (c == 'd' || c == 'u' || c == 'x' || c == 'X' || c == 'p' || c == 'g' ||
+      c == 'f') {
+    int s = (c == 'd'), h = (c == 'x' || c == 'X' || c == 'p');
+    char tmp[40];
+    size_t xl = op->alt ? 2 : 0;
+#if !defined(NO_FLOAT)
+    double dv = 0.0;
+    if (c == 'g' || c == 'f') {
+      dv = va_arg(*ap, double);
+      if (pr == ~0U) pr = 6;
+      k = xdtoa(tmp, sizeof(tmp), dv, (int) pr, c);
+    } else
+#endif
+        if (op->lng == 2) {
+      int64_t v = va_arg(*ap, int64_t);
+      k = xlld(tmp, v, s, h);
+    } else if (op->lng == 1) {
+      long v = va_arg(*ap, long);
+      k = xlld(tmp, s ? (int64_t) v : (int64_t) (unsigned long) v, s, h);
+    } else {
+      int v = va_arg(*ap, int);
+      k = xlld(tmp, s ? (int64_t) v : (int64_t) (unsigned) v, s, h);
+    }
+    for (j = 0; j < xl && w > 0; j++) w--;
+    if (pad == ' ' && !minus && k < w) n += xpad(fn, param, pad, w - k);
+    n += scpy(fn, param, (char *) "0x", xl);
+    if (pad == '0' && k < w) n += xpad(fn, param, pad, w - k);
+#if !defined(NO_FLOAT)
+    if (k >= sizeof(tmp)) {
+      xdtoa_to(fn, param, dv, (int) pr, c);  // Too long for tmp: print again
+      n += k;
+    } else
+#endif
+      n += scpy(fn, param, tmp, k);
+    if (pad == ' ' && minus && k < w) n += xpad(fn, param, pad, w - k);
+  } else if (c == 'm' || c == 'M') {
+    xfmt_t f = va_arg(*ap, xfmt_t);
+    if (c == 'm') fn('"', param);
+    n += f(fn, param, ap);
+    if (c == 'm') n += 2, fn('"', param);
+  } else if (c == 'c') {
+    int ch = va_arg(*ap, int);
+    fn((char) ch, param);
+    n++;
+  } else if (c == 's') {
+    char *p = va_arg(*ap, char *);
+    if (pr == ~0U) pr = p == NULL ? 0 : strlen(p);
+    if (!minus && pr < w) n += xpad(fn, param, pad, w - pr);
+    n += scpy(fn, param, p, pr);
+    if (minus && pr < w) n += xpad(fn, param, pad, w - pr);
+  } else if (c == '%') {
+    fn('%', param);
+    n++;
+  } else {
+    fn('%', param);
+    fn(c, param);
+    n += 2;
+  }
+  return n;
+}
+
+size_t xvprintf(xout_t fn, void *param, const char *fmt, va_list *ap) {
+  struct xfmt_op op;
+  size_t n = 0;
+  while (*fmt != '\0') {
+    fmt = xfmt_parse(fmt, &op);
+    n += xfmt_exec(fn, param, &op, ap);
+  }
+  return n;
+}
+
+size_t xfmt_compile(const char *fmt, struct xfmt_op *ops, size_t nops) {
+  struct xfmt_op op;
+  size_t n = 0;
+  while (*fmt != '\0') {
+    fmt = xfmt_parse(fmt, &op);
+    if (n < nops) ops[n] = op;
+    n++;
+  }
+  return n;
+}
+
+size_t xvprintfc(xout_t fn, void *param, const struct xfmt_op *ops,
+                 size_t nops, va_list *ap) {
+  size_t i, n = 0;
+  for (i = 0; i < nops; i++) n += xfmt_exec(fn, param, &ops[i], ap);
+  return n;
+}
+
+size_t xprintfc(xout_t fn, void *param, const struct xfmt_op *ops, size_t nops,
+                ...) {
+  size_t len = 0;
+  va_list ap;
+  va_start(ap, nops);
+  len = xvprintfc(fn, param, ops, nops, &ap);
+  va_end(ap);
+  return len;
+}
+
+void xlog_init(struct xlog *log, char *buf, size_t size, unsigned flags) {
+  log->buf = buf, log->size = size & ~(size_t) 7;
+  log->head = log->tail = log->dropped = 0, log->flags = flags;
+}
+
+static size_t xacquire(const volatile size_t *p) {
+#if defined(__ATOMIC_ACQUIRE)
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#else
+  return *p;
+#endif
+}
+
+static void xrelease(volatile size_t *p, size_t v) {
+#if defined(__ATOMIC_RELEASE)
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+#else
+  *p = v;
+#endif
+}
+
+// Serialise a record into `r`: its length, the format string pointer, and
+// the arguments of every conversion. Return the length rounded up to 8 bytes,
+// or 0 if the record does not fit into r->size bytes
+static size_t xlog_write(unsigned flags, struct xbuf *r, const char *fmt,
+                         va_list *ap) {
+  struct xfmt_op op;
+  size_t n = 0;
+  r->len = 0;
+  xouts_buf((const char *) &n, sizeof(n), r);  // Length, written at the end
+  xouts_buf((const char *) &fmt, sizeof(fmt), r);
+  while (*fmt != '\0') {
+    size_t pr;
+    char c;
+    fmt = xfmt_parse(fmt, &op), c = op.conv, pr = op.prec;
+    if (op.str != NULL) continue;
+    if ((c == 'm' || c == 'M') && !(flags & XLOG_REF_FMT)) {
+      size_t ofs = r->len;  // Format now, store the text and its length
+      r->len += sizeof(n);
+      n = xfmt_exec(xout_buf, r, &op, ap);
+      if (r->len <= r->size) memcpy(r->buf + ofs, &n, sizeof(n));
+      continue;
+    }
+    if (op.star) {
+      int v = va_arg(*ap, int);
+      xouts_buf((const char *) &v, sizeof(v), r), pr = (size_t) v;
+    }
+    if (c == 'm' || c == 'M') {
+      xfmt_t f = va_arg(*ap, xfmt_t);
+      void *p = va_arg(*ap, void *);
+      xouts_buf((const char *) &f, sizeof(f), r);
+      xouts_buf((const char *) &p, sizeof(p), r);
+    } else if (c == 's') {
+      const char *s = va_arg(*ap, char *);
+      if (flags & XLOG_REF_STR) {
+        xouts_buf((const char *) &s, sizeof(s), r);
+      } else {
+        for (n = 0; s != NULL && n < pr && s[n] != '\0';) n++;
+        xouts_buf(s == NULL ? "" : s, n, r);
+        xout_buf('\0', r);
       }
-      if (c == 'p') x = 1, is_long = 1;
-      if (c == 'd' || c == 'u' || c == 'x' || c == 'X' || c == 'p' ||
-          c == 'g' || c == 'f') {
-        int s = (c == 'd'), h = (c == 'x' || c == 'X' || c == 'p');
-        char tmp[40];
-        size_t xl = x ? 2 : 0;
+    } else if (c == 'c') {
+      xout_buf((char) va_arg(*ap, int), r);
 #if !defined(NO_FLOAT)
-        if (c == 'g' || c == 'f') {
-          double v = va_arg(*ap, double);
-          if (pr == ~0U) pr = 6;
-          k = xdtoa(tmp, sizeof(tmp), v, (int) pr, c == 'g');
-        } else
-#endif
-            if (is_long == 2) {
-          int64_t v = va_arg(*ap, int64_t);
-          k = xlld(tmp, v, s, h);
-        } else if (is_long == 1) {
-          long v = va_arg(*ap, long);
-          k = xlld(tmp, s ? (int64_t) v : (int64_t) (unsigned long) v, s, h);
-        } else {
-          int v = va_arg(*ap, int);
-          k = xlld(tmp, s ? (int64_t) v : (int64_t) (unsigned) v, s, h);
-        }
-        for (j = 0; j < xl && w > 0; j++) w--;
-        for (j = 0; pad == ' ' && !minus && k < w && j + k < w; j++)
-          n += scpy(fn, param, &pad, 1);
-        n += scpy(fn, param, (char *) "0x", xl);
-        for (j = 0; pad == '0' && k < w && j + k < w; j++)
-          n += scpy(fn, param, &pad, 1);
-        n += scpy(fn, param, tmp, k);
-        for (j = 0; pad == ' ' && minus && k < w && j + k < w; j++)
-          n += scpy(fn, param, &pad, 1);
-      } else if (c == 'm' || c == 'M') {
-        xfmt_t f = va_arg(*ap, xfmt_t);
-        if (c == 'm') fn('"', param);
-        n += f(fn, param, ap);
-        if (c == 'm') n += 2, fn('"', param);
-      } else if (c == 'c') {
-        int ch = va_arg(*ap, int);
-        fn((char) ch, param);
-        n++;
-      } else if (c == 's') {
-        char *p = va_arg(*ap, char *);
-        if (pr == ~0U) pr = p == NULL ? 0 : strlen(p);
-        for (j = 0; !minus && pr < w && j + pr < w; j++)
-          n += scpy(fn, param, &pad, 1);
-        n += scpy(fn, param, p, pr);
-        for (j = 0; minus && pr < w && j + pr < w; j++)
-          n += scpy(fn, param, &pad, 1);
-      } else if (c == '%') {
-        fn('%', param);
-        n++;
+    } else if (c == 'g' || c == 'f') {
+      double v = va_arg(*ap, double);
+      xouts_buf((const char *) &v, sizeof(v), r);
+#endif
+    } else if (c == 'd' || c == 'u' || c == 'x' || c == 'X' || c == 'p') {
+      if (op.lng == 2) {
+        int64_t v = va_arg(*ap, int64_t);
+        xouts_buf((const char *) &v, sizeof(v), r);
+      } else if (op.lng == 1) {
+        long v = va_arg(*ap, long);
+        xouts_buf((const char *) &v, sizeof(v), r);
       } else {
-        fn('%', param);
-        fn(c, param);
-        n += 2;
+        int v = va_arg(*ap, int);
+        xouts_buf((const char *) &v, sizeof(v), r);
       }
-      i++;
+    }
+  }
+  if (r->len > r->size) return 0;
+  n = (r->len + 7) & ~(size_t) 7;
+  memcpy(r->buf, &n, sizeof(n));
+  return n;
+}
+
+// Copy `len` bytes of the record at `p` to `dst`, return the rest
+static const char *xlog_get(const char *p, void *dst, size_t len) {
+  memcpy(dst, p, len);
+  return p + len;
+}
+
+// Print a literal run or a conversion `op` of a record, which stores its
+// arguments at `p`. Every conversion is printed by xprintfc(), which gets the
+// stored argument with its original type, except a %s without padding, which
+// is printed directly. If `skip` is not NULL, the first `*skip` bytes of output
+// are not needed: such a %s starts later and zeroes `*skip`. Return the rest
+// of the record
+static const char *xlog_render_op(unsigned flags, struct xfmt_op *op,
+                                  const char *p, xout_t fn, void *param,
+                                  size_t *n, size_t *skip) {
+  char c = op->conv;
+  size_t len;
+  if (op->str != NULL) {
+    *n += xputs(fn, param, op->str, op->len);
+    return p;
+  } else if ((c == 'm' || c == 'M') && !(flags & XLOG_REF_FMT)) {
+    p = xlog_get(p, &len, sizeof(len));
+    *n += xputs(fn, param, p, len);
+    return p + len;
+  }
+  if (op->star) {
+    int v;
+    p = xlog_get(p, &v, sizeof(v));
+    op->star = 0, op->prec = (unsigned) v;
+  }
+  if (c == 'm' || c == 'M') {
+    xfmt_t f;
+    void *ptr;
+    p = xlog_get(p, &f, sizeof(f));
+    p = xlog_get(p, &ptr, sizeof(ptr));
+    *n += xprintfc(fn, param, op, 1, f, ptr);
+  } else if (c == 's' && op->width == 0) {
+    const char *s = p, *e;
+    size_t k = skip == NULL ? 0 : *skip;  // Nothing but the string is printed
+    if (flags & XLOG_REF_STR) {
+      p = xlog_get(p, &s, sizeof(s));
+    } else {
+      p += strlen(p) + 1;
+    }
+    if (s == NULL) return p;
+    if (skip != NULL) *skip = 0;
+    if (op->prec == ~0U) {
+      len = strlen(s + k);
+    } else if ((e = (const char *) memchr(s + k, 0, op->prec - k)) != NULL) {
+      len = (size_t) (e - s) - k;
+    } else {
+      len = op->prec - k;
+    }
+    *n += xputs(fn, param, s + k, len) + k;
+  } else if (c == 's' && (flags & XLOG_REF_STR)) {
+    const char *s;
+    p = xlog_get(p, &s, sizeof(s));
+    *n += xprintfc(fn, param, op, 1, s);
+  } else if (c == 's') {
+    *n += xprintfc(fn, param, op, 1, p), p += strlen(p) + 1;
+  } else if (c == 'c') {
+    *n += xprintfc(fn, param, op, 1, (int) *p++);
+#if !defined(NO_FLOAT)
+  } else if (c == 'g' || c == 'f') {
+    double v;
+    p = xlog_get(p, &v, sizeof(v));
+    *n += xprintfc(fn, param, op, 1, v);
+#endif
+  } else if ((c == 'd' || c == 'u' || c == 'x' || c == 'X' || c == 'p') &&
+             op->lng == 2) {
+    int64_t v;
+    p = xlog_get(p, &v, sizeof(v));
+    *n += xprintfc(fn, param, op, 1, v);
+  } else if ((c == 'd' || c == 'u' || c == 'x' || c == 'X' || c == 'p') &&
+             op->lng == 1) {
+    long v;
+    p = xlog_get(p, &v, sizeof(v));
+    *n += xprintfc(fn, param, op, 1, v);
+  } else if (c == 'd' || c == 'u' || c == 'x' || c == 'X' || c == 'p') {
+    int v;
+    p = xlog_get(p, &v, sizeof(v));
+    *n += xprintfc(fn, param, op, 1, v);
+  } else {
+    *n += xprintfc(fn, param, op, 1);  // %% and unknown conversions
+  }
+  return p;
+}
+
+// Format the record at `p`
+static size_t xlog_render(const struct xlog *log, const char *p, xout_t fn,
+                          void *param) {
+  struct xfmt_op op;
+  const char *fmt;
+  size_t n = 0;
+  p = xlog_get(p + sizeof(size_t), &fmt, sizeof(fmt));
+  while (*fmt != '\0') {
+    fmt = xfmt_parse(fmt, &op);
+    p = xlog_render_op(log->flags, &op, p, fn, param, &n, NULL);
+  }
+  return n;
+}
+
+bool xlog_printf(struct xlog *log, const char *fmt, ...) {
+  size_t n, zero = 0, head = log->head, tail = xacquire(&log->tail);
+  struct xbuf r;
+  va_list ap;
+  // Keep 8 bytes free, so that a full ring does not look empty
+  r.buf = log->buf + head;
+  r.size = head < tail ? tail - head - 8 : log->size - head - (tail ? 0 : 8);
+  va_start(ap, fmt);
+  n = xlog_write(log->flags, &r, fmt, &ap);
+  va_end(ap);
+  if (n == 0 && head >= tail && tail > 0) {  // Wrap around, mark the skip
+    r.buf = log->buf, r.size = tail - 8;
+    va_start(ap, fmt);
+    n = xlog_write(log->flags, &r, fmt, &ap);
+    va_end(ap);
+    if (n > 0) memcpy(log->buf + head, &zero, sizeof(zero)), head = 0;
+  }
+  if (n == 0) {
+    log->dropped++;
+    return false;
+  }
+  head += n;
+  xrelease(&log->head, head == log->size ? 0 : head);
+  return true;
+}
+
+size_t xlog_flush(struct xlog *log, xout_t fn, void *param) {
+  size_t n = 0, len, tail = log->tail, head = xacquire(&log->head);
+  while (tail != head) {
+    memcpy(&len, log->buf + tail, sizeof(len));
+    if (len == 0) {
+      tail = 0;  // Skip marker: the next record is at the start
     } else {
-      fn(fmt[i], param), n++, i++;
+      n += xlog_render(log, log->buf + tail, fn, param), tail += len;
+      if (tail == log->size) tail = 0;
+    }
+    xrelease(&log->tail, tail);
+  }
+  return n;
+}
+
+bool xvprint_start(struct xprint *p, char *buf, size_t size, unsigned flags,
+                   const char *fmt, va_list *ap) {
+  struct xbuf r;
+  r.buf = buf, r.size = size;
+  p->buf = buf, p->flags = flags, p->fmt = fmt, p->skip = 0;
+  p->ofs = sizeof(size_t) + sizeof(fmt);  // Skip the record header
+  return xlog_write(flags, &r, fmt, ap) > 0;
+}
+
+bool xprint_start(struct xprint *p, char *buf, size_t size, unsigned flags,
+                  const char *fmt, ...) {
+  bool ok;
+  va_list ap;
+  va_start(ap, fmt);
+  ok = xvprint_start(p, buf, size, flags, fmt, &ap);
+  va_end(ap);
+  return ok;
+}
+
+// Output of xprint_resume(): skips what has been printed before, and stops
+// when the sink is full
+struct xresume {
+  size_t (*fn)(const char *, size_t, void *);
+  void *param;
+  size_t skip, sent;  // Bytes left to skip, bytes accepted by fn
+  bool full;          // fn has accepted less than it was given
+};
+
+static void xouts_resume(const char *buf, size_t len, void *param) {
+  struct xresume *r = (struct xresume *) param;
+  size_t n;
+  if (r->full) return;
+  if (len <= r->skip) {
+    r->skip -= len;
+    return;
+  }
+  buf += r->skip, len -= r->skip, r->skip = 0;
+  n = r->fn(buf, len, r->param);
+  r->sent += n, r->full = n < len;
+}
+
+// Print conversions one by one. If the sink fills up in the middle of one,
+// remember how much of it was printed: next time, print it again and skip
+// that many bytes. Return true when everything is printed
+bool xprint_resume(struct xprint *p,
+                   size_t (*fn)(const char *, size_t, void *), void *param) {
+  struct xresume r;
+  struct xspan span;
+  struct xfmt_op op;
+  size_t n = 0;
+  r.fn = fn, r.param = param, r.full = false;
+  span.fn = xouts_resume, span.param = &r;
+  while (*p->fmt != '\0') {
+    const char *fmt = xfmt_parse(p->fmt, &op), *rest;
+    r.skip = p->skip, r.sent = 0;
+    rest = xlog_render_op(p->flags, &op, p->buf + p->ofs, xout_span, &span,
+                          &n, &r.skip);
+    if (r.full) {
+      p->skip += r.sent;
+      return false;
+    }
+    p->fmt = fmt, p->ofs = (size_t) (rest - p->buf), p->skip = 0;
+  }
+  return true;
+}
+
+void xflush_init(struct xflush *fl,
+                 size_t (*fn)(const struct xstr *, size_t, void *),
+                 void *param, size_t size, unsigned long deadline) {
+  fl->fn = fn, fl->param = param, fl->sinks = fl->cursor = NULL;
+  fl->size = size, fl->deadline = deadline, fl->last = 0;
+}
+
+// Add a sink to the flusher. Sinks can be added while the flusher runs
+void xsink_init(struct xsink *s, struct xflush *fl, char *buf, size_t size) {
+  s->buf = buf, s->size = 1;
+  while (s->size <= size / 2) s->size *= 2;  // Round down to a power of 2
+  if (size == 0) s->size = 0;
+  s->len = s->commit = s->done = s->dropped = s->closed = 0, s->end = s->size;
+  s->skip = false;
+#if defined(__ATOMIC_RELEASE)
+  s->next = __atomic_load_n(&fl->sinks, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&fl->sinks, &s->next, s, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+#else
+  s->next = fl->sinks, fl->sinks = s;
+#endif
+}
+
+void xouts_sink(const char *buf, size_t len, void *param) {
+  struct xsink *s = (struct xsink *) param;
+  size_t i, pos;
+  for (;;) {
+    while (s->skip && len > 0) s->skip = *buf != '\n', buf++, len--;
+    if (len <= s->end - s->len) break;
+    s->end = xacquire(&s->done) + s->size;
+    if (len <= s->end - s->len) break;
+    s->len = s->commit, s->skip = true, s->dropped++;  // Drop this line
+  }
+  pos = s->len & (s->size - 1), i = s->size - pos;
+  if (len <= i) {
+    memcpy(s->buf + pos, buf, len);
+  } else {
+    memcpy(s->buf + pos, buf, i), memcpy(s->buf, buf + i, len - i);
+  }
+  s->len += len;
+  for (i = len; i > 0 && buf[i - 1] != '\n';) i--;
+  if (i > 0) xrelease(&s->commit, s->len - (len - i));  // Hand lines over
+}
+
+void xout_sink(char ch, void *param) {
+  struct xsink *s = (struct xsink *) param;
+  if (s->len < s->end && !s->skip) {
+    s->buf[s->len++ & (s->size - 1)] = ch;  // Fast path: there is room
+    if (ch == '\n') xrelease(&s->commit, s->len);
+  } else {
+    xouts_sink(&ch, 1, param);
+  }
+}
+
+// Hand over an unfinished line
+void xsink_commit(struct xsink *s) {
+  xrelease(&s->commit, s->len);
+}
+
+// Close a sink: hand over the rest of its data, and let the flusher remove
+// it once everything is written. Return true when the sink is removed and
+// its memory can be reused. Nothing may be printed to a closed sink
+bool xsink_close(struct xsink *s) {
+  if (xacquire(&s->closed) == 0) xsink_commit(s), xrelease(&s->closed, 1);
+  return xacquire(&s->closed) == 2;
+}
+
+// Remove a sink from the list. Other threads may add sinks at the head,
+// but only the flusher changes the links past it
+static void xflush_unlink(struct xflush *fl, struct xsink *s) {
+  struct xsink *p = s;
+#if defined(__ATOMIC_ACQUIRE)
+  bool head = __atomic_compare_exchange_n(&fl->sinks, &p, s->next, false,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE);
+#else
+  bool head = (p = fl->sinks) == s;
+  if (head) fl->sinks = s->next;
+#endif
+  if (!head) {
+    while (p->next != s) p = p->next;
+    p->next = s->next;
+  }
+  if (fl->cursor == s) fl->cursor = s->next;
+  xrelease(&s->closed, 2);  // The owner can reuse it now
+}
+
+// If enough bytes are pending, or the deadline has passed, write committed
+// data of all sinks, in batches of up to XFLUSH_IOV spans. Return the number
+// of bytes written. If fl->fn writes less than asked, stop: the rest is
+// retried on the next call, starting from the sink that was cut short, so
+// that every sink gets its turn
+size_t xflush_poll(struct xflush *fl, unsigned long now) {
+  struct xstr v[XFLUSH_IOV];
+  struct xsink *owner[XFLUSH_IOV], *s, *head, *next;
+  size_t i, k, nv, n = 0, total = 0, nsinks = 0, visited = 0;
+#if defined(__ATOMIC_ACQUIRE)
+  head = __atomic_load_n(&fl->sinks, __ATOMIC_ACQUIRE);
+#else
+  head = fl->sinks;
+#endif
+  for (s = head; s != NULL; s = next) {  // Remove closed, written out sinks
+    next = s->next;
+    if (xacquire(&s->closed) == 1 && xacquire(&s->commit) == s->done) {
+      if (s == head) head = next;
+      xflush_unlink(fl, s);
+    }
+  }
+  for (s = head; s != NULL; s = s->next, nsinks++) {
+    n += xacquire(&s->commit) - s->done;
+  }
+  if (n == 0 || (n < fl->size && now - fl->last < fl->deadline)) return 0;
+  for (s = fl->cursor; visited < nsinks;) {
+    for (nv = 0; visited < nsinks && nv + 2 <= XFLUSH_IOV; visited++) {
+      size_t pos;
+      if (s == NULL) s = head;  // Wrap around
+      pos = s->done & (s->size - 1), k = xacquire(&s->commit) - s->done;
+      if (k > 0) {
+        v[nv].buf = s->buf + pos, owner[nv] = s;
+        v[nv++].len = k < s->size - pos ? k : s->size - pos;
+        if (k > v[nv - 1].len) {  // Wrapped around the end of the ring
+          v[nv].buf = s->buf, v[nv].len = k - v[nv - 1].len, owner[nv++] = s;
+        }
+      }
+      s = s->next;
+    }
+    if (nv == 0) break;
+    n = fl->fn(v, nv, fl->param), fl->last = now, total += n, fl->cursor = s;
+    for (i = 0, k = n; i < nv && k > 0; i++) {
+      size_t m = v[i].len < k ? v[i].len : k;
+      xrelease(&owner[i]->done, owner[i]->done + m), k -= m;
+    }
+    for (i = 0; i < nv && n >= v[i].len; i++) n -= v[i].len;
+    if (i < nv) {  // Short write
+      fl->cursor = owner[i];
+      break;
+    }
+  }
+  return total;
+}
+
+#if defined(STR_POSIX)
+// Batch write function for xflush: write spans to a file descriptor
+size_t xflush_writev(const struct xstr *v, size_t n, void *fd) {
+  struct iovec iov[XFLUSH_IOV];
+  size_t i, total = 0;
+  int cnt = 0;
+  for (i = 0; i < n && i < XFLUSH_IOV; i++) {
+    iov[i].iov_base = v[i].buf, iov[i].iov_len = v[i].len, cnt++;
+  }
+  for (i = 0; cnt > 0;) {
+    ssize_t r = writev(*(int *) fd, iov + i, cnt - (int) i);
+    size_t w = (size_t) r;
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    for (total += w; i < (size_t) cnt && w >= iov[i].iov_len; i++) {
+      w -= iov[i].iov_len;  // Skip spans written completely
     }
+    if (i == (size_t) cnt) break;
+    iov[i].iov_base = (char *) iov[i].iov_base + w, iov[i].iov_len -= w;
   }
-  return n;
+  return total;
 }
+#endif
 
 static char json_esc(int c, int esc) {
   const char *p, *e[] = {"\b\f\n\r\t\\\"", "bfnrt\\\""};
@@ -441,9 +2224,67 @@ static char json_esc(int c, int esc) {
   return 0;
 }
 
+// Return the offset of the first quote, backslash or NUL in `s` starting from
+// `i`, or `len`. Skip 16 bytes at a time with SSE2, then 8 bytes with SWAR
+static int json_pass_plain(const char *s, int i, int len) {
+  uint64_t v, h = XU64(0x80808080, 0x80808080);
+#if defined(__SSE2__) && !defined(STR_NO_SIMD)
+  __m128i q = _mm_set1_epi8('"'), b = _mm_set1_epi8('\\'),
+          z = _mm_setzero_si128();
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (s + i));
+    int m = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(x, q), _mm_cmpeq_epi8(x, b)),
+        _mm_cmpeq_epi8(x, z)));
+    if (m != 0) return i + __builtin_ctz((unsigned) m);
+  }
+#endif
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&v, s + i, sizeof(v));
+    if ((xnonzero(v) & xnonzero(v ^ XU64(0x22222222, 0x22222222)) &
+         xnonzero(v ^ XU64(0x5c5c5c5c, 0x5c5c5c5c)) & h) != h) {
+      break;
+    }
+  }
+  while (i < len && s[i] != '"' && s[i] != '\\' && s[i] != '\0') i++;
+  return i;
+}
+
+// Return the offset of the first non-whitespace character in `s` starting
+// from `i`, or `len`
+static int json_pass_space(const char *s, int i, int len) {
+  uint64_t v, h = XU64(0x80808080, 0x80808080);
+#if defined(__SSE2__) && !defined(STR_NO_SIMD)
+  __m128i sp = _mm_set1_epi8(' '), t = _mm_set1_epi8('\t'),
+          n = _mm_set1_epi8('\n'), r = _mm_set1_epi8('\r');
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (s + i));
+    int m = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(x, sp), _mm_cmpeq_epi8(x, t)),
+        _mm_or_si128(_mm_cmpeq_epi8(x, n), _mm_cmpeq_epi8(x, r))));
+    if (m != 0xffff) return i + __builtin_ctz((unsigned) ~m);
+  }
+#endif
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&v, s + i, sizeof(v));
+    if ((xnonzero(v ^ XU64(0x20202020, 0x20202020)) &
+         xnonzero(v ^ XU64(0x09090909, 0x09090909)) &
+         xnonzero(v ^ XU64(0x0a0a0a0a, 0x0a0a0a0a)) &
+         xnonzero(v ^ XU64(0x0d0d0d0d, 0x0d0d0d0d)) & h) != 0) {
+      break;
+    }
+  }
+  while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' ||
+                     s[i] == '\r')) {
+    i++;
+  }
+  return i;
+}
+
 static int json_pass_string(const char *s, int len) {
   int i;
-  for (i = 0; i < len; i++) {
+  for (i = json_pass_plain(s, 0, len); i < len;
+       i = json_pass_plain(s, i + 1, len)) {
     if (s[i] == '\\' && i + 1 < len && json_esc(s[i + 1], 1)) {
       i++;
     } else if (s[i] == '\0') {
@@ -455,64 +2296,110 @@ static int json_pass_string(const char *s, int len) {
   return -1;
 }
 
-int json_get(const char *s, int len, const char *path, int *toklen) {
+#define JSON_MANY 16  // Number of paths looked up in one pass
+
+// Look up `np` <= JSON_MANY paths in one pass over the JSON string `s`,
+// `len`. Store offsets of found elements, or negative error codes, into
+// `ofs`, and their lengths into `lens`. Return the number of found elements
+static int json_scan(const char *s, int len, const char **paths, int np,
+                     int *ofs, int *lens) {
   enum { S_VALUE, S_KEY, S_COLON, S_COMMA_OR_EOO } expecting = S_VALUE;
   unsigned char nesting[20];
-  int i = 0;             // Current offset in `s`
-  int j = 0;             // Offset in `s` we're looking for (return value)
-  int depth = 0;         // Current depth (nesting level)
-  int ed = 0;            // Expected depth
-  int pos = 1;           // Current position in `path`
-  int ci = -1, ei = -1;  // Current and expected index in array
+  int start[21];  // Per depth: offset of the current value
+  int count[21];  // Per depth: number of values seen in the current array
+  int ed[JSON_MANY];   // Per path: expected depth, or -1 if resolved
+  int pos[JSON_MANY];  // Per path: current position in the path
+  int ei[JSON_MANY];   // Per path: expected index in array, or -1
+  int i = 0;           // Current offset in `s`
+  int depth = 0;       // Current depth (nesting level)
+  int hi = 0;          // Maximum expected depth: deeper values are skipped
+  int k, pending = 0, found = 0;
+
+  for (k = 0; k < np; k++) {
+    lens[k] = 0, ofs[k] = -2, ed[k] = 0, pos[k] = 1, ei[k] = -1, pending++;
+    if (paths[k][0] != '$') ofs[k] = -1, ed[k] = -1, pending--;
+  }
+  if (pending == 0) return found;
+
+// A path matches if it ended at the current depth, and the current element
+// is the expected one. The element count only matters inside arrays
+#define MG_INDEX(k) (ei[k] < 0 ? -1 : count[ed[k]])
+#define MG_DONE(k, v) (ofs[k] = (v), ed[k] = -1, pending--)
+#define MG_HI()                                \
+  do {                                         \
+    int h_;                                    \
+    for (hi = -1, h_ = 0; h_ < np; h_++) {     \
+      if (ed[h_] > hi) hi = ed[h_];            \
+    }                                          \
+  } while (0)
 
-  if (toklen) *toklen = 0;
-  if (path[0] != '$') return -1;
+#define MG_CHECKRET()                                                    \
+  do {                                                                   \
+    for (k = 0; k < np && depth <= hi; k++) {                            \
+      if (ed[k] == depth && paths[k][pos[k]] == '\0' &&                  \
+          MG_INDEX(k) == ei[k]) {                                        \
+        lens[k] = i - start[depth] + 1, MG_DONE(k, start[depth]);        \
+        found++;                                                         \
+        if (pending == 0) return found;                                  \
+        MG_HI();                                                         \
+      }                                                                  \
+    }                                                                    \
+  } while (0)
 
-#define MG_CHECKRET()                                   \
-  do {                                                  \
-    if (depth == ed && path[pos] == '\0' && ci == ei) { \
-      if (toklen) *toklen = i - j + 1;                  \
-      return j;                                         \
-    }                                                   \
+#define MG_FAIL(code)                            \
+  do {                                           \
+    for (k = 0; k < np; k++) {                   \
+      if (ed[k] >= 0) ofs[k] = (code);           \
+    }                                            \
+    return found;                                \
   } while (0)
 
 // In the ascii table, the distance between `[` and `]` is 2.
 // Ditto for `{` and `}`. Hence +2 in the code below.
-#define MG_EOO()                                \
-  do {                                          \
-    if (depth == ed && ci != ei) return -2;     \
-    if (c != nesting[depth - 1] + 2) return -1; \
-    depth--;                                    \
-    MG_CHECKRET();                              \
+#define MG_EOO()                                                        \
+  do {                                                                  \
+    if (depth <= hi) {                                                  \
+      for (k = 0; k < np; k++) {                                        \
+        if (ed[k] == depth && MG_INDEX(k) != ei[k]) MG_DONE(k, -2);     \
+      }                                                                 \
+      if (pending == 0) return found;                                   \
+      MG_HI();                                                          \
+    }                                                                   \
+    if (c != nesting[depth - 1] + 2) MG_FAIL(-1);                       \
+    depth--;                                                            \
+    MG_CHECKRET();                                                      \
   } while (0)
 
   for (i = 0; i < len; i++) {
     unsigned char c = ((unsigned char *) s)[i];
-    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') continue;
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      if (i + 1 < len && (s[i + 1] == ' ' || s[i + 1] == '\n')) {
+        i = json_pass_space(s, i + 1, len) - 1;  // Skip indentation
+      }
+      continue;
+    }
     switch (expecting) {
       case S_VALUE:
-        // p("V %s [%.*s] %d %d %d %d\n", path, pos, path, depth, ed, ci, ei);
-        if (depth == ed) j = i;
-        if (c == '{') {
-          if (depth >= (int) sizeof(nesting)) return -3;
-          if (depth == ed && path[pos] == '.' && ci == ei) {
-            // If we start the object, reset array indices
-            ed++, pos++, ci = ei = -1;
-          }
-          nesting[depth++] = c;
-          expecting = S_KEY;
-          break;
-        } else if (c == '[') {
-          if (depth >= (int) sizeof(nesting)) return -3;
-          if (depth == ed && path[pos] == '[' && ei == ci) {
-            ed++, pos++, ci = 0;
-            for (ei = 0; path[pos] != ']' && path[pos] != '\0'; pos++) {
-              ei *= 10;
-              ei += path[pos] - '0';
+        start[depth] = i;
+        if (c == '{' || c == '[') {
+          if (depth >= (int) sizeof(nesting)) MG_FAIL(-3);
+          for (k = 0; k < np && depth <= hi; k++) {
+            const char *p = paths[k];
+            if (ed[k] != depth || MG_INDEX(k) != ei[k]) continue;
+            if (c == '{' && p[pos[k]] == '.') {
+              // If we start the object, reset array indices
+              ed[k]++, pos[k]++, ei[k] = -1;
+            } else if (c == '[' && p[pos[k]] == '[') {
+              ed[k]++, pos[k]++;
+              for (ei[k] = 0; p[pos[k]] != ']' && p[pos[k]] != '\0';) {
+                ei[k] = ei[k] * 10 + p[pos[k]++] - '0';
+              }
+              if (p[pos[k]] != 0) pos[k]++;
             }
-            if (path[pos] != 0) pos++;
+            if (ed[k] > hi) hi = ed[k];
           }
-          nesting[depth++] = c;
+          nesting[depth++] = c, count[depth] = 0;
+          if (c == '{') expecting = S_KEY;
           break;
         } else if (c == ']' && depth > 0) {  // Empty array
           MG_EOO();
@@ -523,47 +2410,49 @@ int json_get(const char *s, int len, const char *path, int *toklen) {
         } else if (c == 'f' && i + 4 < len && memcmp(&s[i], "false", 5) == 0) {
           i += 4;
         } else if (c == '-' || ((c >= '0' && c <= '9'))) {
-          int numlen = 0;
-          xatod(&s[i], len - i, &numlen);
-          i += numlen - 1;
+          i += json_pass_number(&s[i], len - i) - 1;
         } else if (c == '"') {
           int n = json_pass_string(&s[i + 1], len - i - 1);
-          if (n < 0) return n;
+          if (n < 0) MG_FAIL(n);
           i += n + 1;
         } else {
-          return -1;
+          MG_FAIL(-1);
         }
         MG_CHECKRET();
-        if (depth == ed && ei >= 0) ci++;
+        count[depth]++;
         expecting = S_COMMA_OR_EOO;
         break;
 
       case S_KEY:
         if (c == '"') {
           int n = json_pass_string(&s[i + 1], len - i - 1);
-          if (n < 0) return n;
-          if (i + 1 + n >= len) return -2;
-          if (depth < ed) return -2;
-          if (depth == ed && path[pos - 1] != '.') return -2;
-          // printf("K %s [%.*s] [%.*s] %d %d %d\n", path, pos, path, n,
-          //  &s[i + 1], n, depth, ed);
-          // NOTE(cpq): in the check sequence below is important.
-          // strncmp() must go first: it fails fast if the remaining length of
-          // the path is smaller than `n`.
-          if (depth == ed && path[pos - 1] == '.' &&
-              strncmp(&s[i + 1], &path[pos], (size_t) n) == 0 &&
-              (path[pos + n] == '\0' || path[pos + n] == '.' ||
-               path[pos + n] == '[')) {
-            pos += n;
+          if (n < 0) MG_FAIL(n);
+          if (i + 1 + n >= len) MG_FAIL(-2);
+          for (k = 0; k < np && depth <= hi; k++) {
+            const char *p = paths[k];
+            if (ed[k] < 0) continue;
+            if (depth < ed[k] || (depth == ed[k] && p[pos[k] - 1] != '.')) {
+              MG_DONE(k, -2);
+            } else if (depth == ed[k] &&
+                       strncmp(&s[i + 1], &p[pos[k]], (size_t) n) == 0 &&
+                       (p[pos[k] + n] == '\0' || p[pos[k] + n] == '.' ||
+                        p[pos[k] + n] == '[')) {
+              // NOTE(cpq): in the check sequence above is important.
+              // strncmp() must go first: it fails fast if the remaining
+              // length of the path is smaller than `n`.
+              pos[k] += n;
+            }
           }
+          if (pending == 0) return found;
+          MG_HI();
           i += n + 1;
           expecting = S_COLON;
         } else if (c == '}') {  // Empty object
           MG_EOO();
           expecting = S_COMMA_OR_EOO;
-          if (depth == ed && ei >= 0) ci++;
+          count[depth]++;
         } else {
-          return -1;
+          MG_FAIL(-1);
         }
         break;
 
@@ -571,27 +2460,336 @@ int json_get(const char *s, int len, const char *path, int *toklen) {
         if (c == ':') {
           expecting = S_VALUE;
         } else {
-          return -1;
+          MG_FAIL(-1);
         }
         break;
 
       case S_COMMA_OR_EOO:
         if (depth <= 0) {
-          return -1;
+          MG_FAIL(-1);
         } else if (c == ',') {
           expecting = (nesting[depth - 1] == '{') ? S_KEY : S_VALUE;
         } else if (c == ']' || c == '}') {
           MG_EOO();
-          if (depth == ed && ei >= 0) ci++;
+          count[depth]++;
         } else {
-          return -1;
+          MG_FAIL(-1);
         }
         break;
     }
   }
+  return found;
+}
+
+int json_get(const char *s, int len, const char *path, int *toklen) {
+  int ofs, n;
+  json_scan(s, len, &path, 1, &ofs, &n);
+  if (toklen) *toklen = n;
+  return ofs;
+}
+
+int json_get_many(const char *buf, int len, const char **paths, int n,
+                  int *ofs, int *lens) {
+  int i, found = 0;
+  for (i = 0; i < n; i += JSON_MANY) {
+    int np = n - i < JSON_MANY ? n - i : JSON_MANY;
+    found += json_scan(buf, len, paths + i, np, ofs + i, lens + i);
+  }
+  return found;
+}
+
+// Iterate over elements of an object or array `s`, `len`. Start with `ofs`
+// 0, then pass the returned offset. Return 0 when there are no more elements
+int json_next(const char *s, int len, int ofs, struct xstr *key,
+              struct xstr *val) {
+  int i = 1, o, n = 0;
+  if (len <= 0 || (s[0] != '{' && s[0] != '[')) return 0;
+  if (ofs > 0) {
+    i = json_pass_space(s, ofs, len);
+    if (i >= len || s[i++] != ',') return 0;
+  }
+  i = json_pass_space(s, i, len);
+  if (i >= len || s[i] == '}' || s[i] == ']') return 0;
+  key->buf = NULL, key->len = 0;
+  if (s[0] == '{') {
+    if (s[i] != '"' || json_get(&s[i], len - i, "$", &n) != 0) return 0;
+    key->buf = (char *) &s[i], key->len = (size_t) n;
+    i = json_pass_space(s, i + n, len);
+    if (i >= len || s[i++] != ':') return 0;
+  }
+  if ((o = json_get(&s[i], len - i, "$", &n)) < 0) return 0;
+  val->buf = (char *) &s[i + o], val->len = (size_t) n;
+  return i + o + n;
+}
+
+// Record every value and key of the JSON string `s`, `len` into `t`. Return
+// the number of tokens, which is larger than `nt` if `t` is too small, or a
+// negative value on error, like json_get()
+int json_index(const char *s, int len, struct json_tok *t, int nt) {
+  enum { S_VALUE, S_KEY, S_COLON, S_COMMA_OR_EOO } expecting = S_VALUE;
+  unsigned char nesting[20];
+  int stack[20];  // Token indices of open objects and arrays
+  int i, k, n = 0, depth = 0;
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = ((unsigned char *) s)[i];
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      i = json_pass_space(s, i + 1, len) - 1;
+      continue;
+    }
+    if (c == ']' || c == '}') {
+      if (depth <= 0 || expecting == S_COLON ||
+          (expecting == S_VALUE && c == '}') ||
+          (expecting == S_KEY && c == ']') || c != nesting[depth - 1] + 2) {
+        return -1;
+      }
+      k = stack[--depth];
+      if (k < nt) t[k].len = i - t[k].ofs + 1, t[k].next = n;
+    } else if (expecting == S_COLON) {
+      if (c != ':') return -1;
+      expecting = S_VALUE;
+      continue;
+    } else if (expecting == S_COMMA_OR_EOO) {
+      if (c != ',') return -1;
+      expecting = nesting[depth - 1] == '{' ? S_KEY : S_VALUE;
+      continue;
+    } else {
+      if (expecting == S_KEY && c != '"') return -1;
+      if (n < nt) {
+        t[n].ofs = i, t[n].len = 1, t[n].next = n + 1;
+        t[n].parent = depth > 0 ? stack[depth - 1] : -1;
+      }
+      k = n++;
+      if (c == '{' || c == '[') {
+        if (depth >= (int) sizeof(nesting)) return -3;
+        nesting[depth] = c, stack[depth++] = k;
+        expecting = c == '{' ? S_KEY : S_VALUE;
+        continue;
+      } else if (c == 't' && i + 3 < len && memcmp(&s[i], "true", 4) == 0) {
+        i += 3;
+      } else if (c == 'n' && i + 3 < len && memcmp(&s[i], "null", 4) == 0) {
+        i += 3;
+      } else if (c == 'f' && i + 4 < len && memcmp(&s[i], "false", 5) == 0) {
+        i += 4;
+      } else if (c == '-' || ((c >= '0' && c <= '9'))) {
+        i += json_pass_number(&s[i], len - i) - 1;
+      } else if (c == '"') {
+        int m = json_pass_string(&s[i + 1], len - i - 1);
+        if (m < 0) return m;
+        i += m + 1;
+      } else {
+        return -1;
+      }
+      if (k < nt) t[k].len = i - t[k].ofs + 1;
+      if (expecting == S_KEY) {
+        expecting = S_COLON;
+        continue;
+      }
+    }
+    // Value `k` is complete. If it is a member of an object, link its key
+    if (depth > 0 && nesting[depth - 1] == '{' && k - 1 < nt) t[k - 1].next = n;
+    if (depth == 0) return n;
+    expecting = S_COMMA_OR_EOO;
+  }
   return -2;
 }
 
+// Find the element specified by JSON `path` in the index `t`, `nt` built by
+// json_index() for the JSON string `s`. Return its offset, or a negative
+// value if not found, and store the element's length in `toklen`
+int json_index_get(const char *s, const struct json_tok *t, int nt,
+                   const char *path, int *toklen) {
+  int k = 0, c, m, pos = 1;
+  if (toklen) *toklen = 0;
+  if (path[0] != '$') return -1;
+  if (nt <= 0) return -2;
+  while (path[pos] != '\0') {
+    int end = t[k].next < nt ? t[k].next : nt;
+    if (path[pos] == '.' && s[t[k].ofs] == '{') {
+      for (pos++, c = k + 1; c < end; c = t[c].next) {
+        m = t[c].len - 2;  // Key length without quotes
+        if (strncmp(&s[t[c].ofs + 1], &path[pos], (size_t) m) == 0 &&
+            (path[pos + m] == '\0' || path[pos + m] == '.' ||
+             path[pos + m] == '[')) {
+          break;
+        }
+      }
+      if (c >= end) return -2;
+      k = c + 1, pos += m;
+    } else if (path[pos] == '[' && s[t[k].ofs] == '[') {
+      for (m = 0, pos++; path[pos] != ']' && path[pos] != '\0'; pos++) {
+        m = m * 10 + path[pos] - '0';
+      }
+      if (path[pos] != '\0') pos++;
+      for (c = k + 1; c < end && m > 0; c = t[c].next) m--;
+      if (c >= end) return -2;
+      k = c;
+    } else {
+      return -2;
+    }
+  }
+  if (toklen) *toklen = t[k].len;
+  return t[k].ofs;
+}
+
+void json_stream_init(struct json_stream *st, char *buf, int size,
+                      void (*fn)(int, const char *, const char *, int, void *),
+                      void *param) {
+  memset(st, 0, sizeof(*st));
+  st->fn = fn, st->param = param, st->buf = buf, st->size = size;
+  st->expect = 'v', st->path[0] = '$', st->plen = 1;
+}
+
+// Append a part of a token split between chunks to the token buffer
+static int json_stream_save(struct json_stream *st, const char *p, int n) {
+  if (st->len + n > st->size) return -3;
+  memcpy(st->buf + st->len, p, (size_t) n), st->len += n;
+  return 0;
+}
+
+static void json_stream_emit(struct json_stream *st, int ev, const char *p,
+                             int n) {
+  st->path[st->plen] = '\0';
+  st->fn(ev, st->path, p, n, st->param);
+}
+
+// A value is complete. Return 1 if it is the top level value
+static int json_stream_next(struct json_stream *st) {
+  if (st->depth == 0) return 1;
+  st->count[st->depth - 1]++;
+  st->expect = ',';
+  return 0;
+}
+
+// Set the path of the next array element
+static int json_stream_elem(struct json_stream *st) {
+  int b = st->base[st->depth - 1];
+  size_t n = xsnprintf(&st->path[b], sizeof(st->path) - (size_t) b, "[%d]",
+                       st->count[st->depth - 1]);
+  if (b + (int) n >= (int) sizeof(st->path)) return -3;
+  st->plen = b + (int) n;
+  return 0;
+}
+
+static int json_stream_close(struct json_stream *st, const char *p) {
+  if (st->depth <= 0 || *p != st->nesting[st->depth - 1] + 2) return -1;
+  st->depth--, st->plen = st->base[st->depth];
+  json_stream_emit(st, JSON_EV_CLOSE, p, 1);
+  return json_stream_next(st);
+}
+
+// A key, a string, a number or a literal `p`, `n` is complete
+static int json_stream_token(struct json_stream *st, const char *p, int n) {
+  if (st->len > 0) {
+    if (json_stream_save(st, p, n) < 0) return -3;
+    p = st->buf, n = st->len, st->len = 0;
+  }
+  st->tok = 0;
+  if (st->expect == 'k') {
+    int b = st->base[st->depth - 1];
+    if (b + n > (int) sizeof(st->path)) return -3;  // "." + key + NUL
+    st->path[b] = '.', memcpy(&st->path[b + 1], p + 1, (size_t) (n - 2));
+    st->plen = b + n - 1, st->expect = ':';
+    return 0;
+  } else if (p[0] == '-' || xisdigit(p[0])) {
+    if (json_pass_number(p, n) != n || !xisdigit(p[n - 1])) return -1;
+  } else if (p[0] != '"' &&
+             !(n == 4 && (memcmp(p, "true", 4) == 0 ||
+                          memcmp(p, "null", 4) == 0)) &&
+             !(n == 5 && memcmp(p, "false", 5) == 0)) {
+    return -1;
+  }
+  json_stream_emit(st, JSON_EV_VALUE, p, n);
+  return json_stream_next(st);
+}
+
+// Parse the next chunk `s`, `len` of a JSON document. Tokens that are split
+// between chunks are copied to the token buffer, the rest is not copied.
+// Return 0 if more data is expected, a negative value on error, or the
+// number of bytes consumed when the document is complete
+int json_stream_feed(struct json_stream *st, const char *s, int len) {
+  int i, r = 0, from = 0;  // `from` is where the current token starts
+  for (i = 0; i < len && r == 0; i++) {
+    unsigned char c = ((unsigned char *) s)[i];
+    int space = c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    if (st->tok == '"') {
+      i = json_pass_plain(s, i, len);
+      if (i >= len) break;
+      if (s[i] == '\\') {
+        st->tok = '\\';
+      } else if (s[i] == '\0') {
+        r = -1;
+      } else {
+        r = json_stream_token(st, &s[from], i + 1 - from);
+      }
+      continue;
+    } else if (st->tok == '\\') {  // Escaped character
+      st->tok = '"';
+      continue;
+    } else if (st->tok == 'n') {  // A number or a literal ends at a delimiter
+      if (c == '-' || c == '+' || c == '.' || xisdigit(c) ||
+          (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+        continue;
+      }
+      if ((r = json_stream_token(st, &s[from], i - from)) != 0) {
+        if (r > 0 && !space) r = -1;  // Top level number must end with space
+        continue;
+      }
+    }
+    if (space) {
+      i = json_pass_space(s, i + 1, len) - 1;
+    } else if (c == ']' || c == '}') {
+      if (st->expect == ':' || (st->expect == 'v' && c == '}') ||
+          (st->expect == 'k' && c == ']') ||
+          (st->expect != ',' && st->depth > 0 &&
+           st->count[st->depth - 1] > 0)) {
+        r = -1;
+      } else {
+        r = json_stream_close(st, &s[i]);
+      }
+    } else if (st->expect == ':') {
+      if (c == ':') st->expect = 'v';
+      if (c != ':') r = -1;
+    } else if (st->expect == ',') {
+      if (c != ',') {
+        r = -1;
+      } else if (st->nesting[st->depth - 1] == '{') {
+        st->expect = 'k';
+      } else {
+        st->expect = 'v', r = json_stream_elem(st);
+      }
+    } else if (st->expect == 'k') {
+      if (c == '"') st->tok = '"', from = i;
+      if (c != '"') r = -1;
+    } else if (c == '{' || c == '[') {
+      if (st->depth >= JSON_STREAM_DEPTH) {
+        r = -3;
+      } else {
+        json_stream_emit(st, JSON_EV_OPEN, &s[i], 1);
+        st->nesting[st->depth] = c, st->base[st->depth] = st->plen;
+        st->count[st->depth++] = 0;
+        st->expect = c == '{' ? 'k' : 'v';
+        if (c == '[') r = json_stream_elem(st);
+      }
+    } else if (c == '"') {
+      st->tok = '"', from = i;
+    } else if (c == '-' || xisdigit(c) || c == 't' || c == 'f' || c == 'n') {
+      st->tok = 'n', from = i;
+    } else {
+      r = -1;
+    }
+  }
+  if (r < 0) return r;
+  if (r > 0) {
+    json_stream_init(st, st->buf, st->size, st->fn, st->param);
+    return i;
+  }
+  if (st->tok != 0 && json_stream_save(st, &s[from], len - from) < 0) {
+    return -3;
+  }
+  return 0;
+}
+
 static unsigned char xnimble(unsigned char c) {
   return (c >= '0' && c <= '9')   ? (unsigned char) (c - '0')
          : (c >= 'A' && c <= 'F') ? (unsigned char) (c - '7')
@@ -604,17 +2802,74 @@ static unsigned long xunhexn(const char *s, size_t len) {
   return v;
 }
 
+static int xishex(int c) {
+  return xisdigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static int json_hex4(const char *s, size_t len, uint32_t *v) {
+  size_t i;
+  if (len < 6 || s[0] != '\\' || s[1] != 'u') return 0;
+  for (i = 2; i < 6; i++) {
+    if (!xishex(s[i])) return 0;
+  }
+  *v = (uint32_t) xunhexn(s + 2, 4);
+  return 1;
+}
+
+// Decode \uXXXX escape at `s`, or a surrogate pair \uXXXX\uXXXX, into a
+// code point `cp`. Return the length of the escape, or 0 if it is invalid
+static int json_unicode(const char *s, size_t len, uint32_t *cp) {
+  uint32_t lo;
+  if (!json_hex4(s, len, cp) || (*cp >= 0xdc00 && *cp < 0xe000)) return 0;
+  if (*cp < 0xd800 || *cp >= 0xdc00) return 6;
+  if (!json_hex4(s + 6, len - 6, &lo) || lo < 0xdc00 || lo >= 0xe000) return 0;
+  *cp = 0x10000 + ((*cp - 0xd800) << 10) + (lo - 0xdc00);
+  return 12;
+}
+
+// Encode code point `cp` as UTF-8 into `buf`. Return the number of bytes
+static size_t xutf8_put(char *buf, uint32_t cp) {
+  uint8_t *p = (uint8_t *) buf;
+  if (cp < 0x80) {
+    p[0] = (uint8_t) cp;
+    return 1;
+  } else if (cp < 0x800) {
+    p[0] = (uint8_t) (0xc0 | (cp >> 6));
+    p[1] = (uint8_t) (0x80 | (cp & 0x3f));
+    return 2;
+  } else if (cp < 0x10000) {
+    p[0] = (uint8_t) (0xe0 | (cp >> 12));
+    p[1] = (uint8_t) (0x80 | ((cp >> 6) & 0x3f));
+    p[2] = (uint8_t) (0x80 | (cp & 0x3f));
+    return 3;
+  } else {
+    p[0] = (uint8_t) (0xf0 | (cp >> 18));
+    p[1] = (uint8_t) (0x80 | ((cp >> 12) & 0x3f));
+    p[2] = (uint8_t) (0x80 | ((cp >> 6) & 0x3f));
+    p[3] = (uint8_t) (0x80 | (cp & 0x3f));
+    return 4;
+  }
+}
+
+// Unescape `buf`, `len` into `to`, `n`. `to` can be the same as `buf`
 static int json_unescape(const char *buf, size_t len, char *to, size_t n) {
-  size_t i, j;
+  size_t i, j, k;
   for (i = 0, j = 0; i < len && j < n; i++, j++) {
-    if (buf[i] == '\\' && i + 5 < len && buf[i + 1] == 'u') {
-      //  \uXXXX escape. We could process a simple one-byte chars
-      // \u00xx from the ASCII range. More complex chars would require
-      // dragging in a UTF8 library, which is too much for us
-      if (buf[i + 2] != '0' || buf[i + 3] != '0') return -1;  // Give up
-      ((unsigned char *) to)[j] = (unsigned char) xunhexn(buf + i + 4, 2);
-      i += 5;
-    } else if (buf[i] == '\\' && i + 1 < len) {
+    if (buf[i] != '\\') {  // Copy a run of unescaped characters at once
+      k = (size_t) json_pass_plain(buf, (int) i, (int) len) - i;
+      if (k < 2) k = 1;
+      if (j + k > n) k = n - j;
+      memmove(to + j, buf + i, k);
+      i += k - 1, j += k - 1;
+    } else if (i + 1 < len && buf[i + 1] == 'u') {  // \uXXXX escape
+      char u[4];
+      uint32_t cp;
+      size_t m, e = (size_t) json_unicode(buf + i, len - i, &cp);
+      if (e == 0) return -1;
+      if (j + (m = xutf8_put(u, cp)) > n) return -1;
+      memcpy(to + j, u, m);  // UTF-8 is shorter than the escape
+      i += e - 1, j += m - 1;
+    } else if (i + 1 < len) {
       char c = json_esc(buf[i + 1], 0);
       if (c == 0) return -1;
       to[j] = c;
@@ -628,29 +2883,107 @@ static int json_unescape(const char *buf, size_t len, char *to, size_t n) {
   return (int) j;
 }
 
+// Check that `buf`, `len` is valid UTF-8. Skip ASCII 16 bytes at a time
+// with SSE2, or 8 bytes with SWAR
+bool xutf8_valid(const char *buf, size_t len) {
+  const uint8_t *s = (const uint8_t *) buf;
+  size_t i = 0, k, n;
+  uint64_t v;
+  while (i < len) {
+#if defined(__SSE2__) && !defined(STR_NO_SIMD)
+    while (i + 16 <= len &&
+           _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (s + i))) == 0) {
+      i += 16;
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+      memcpy(&v, s + i, sizeof(v));
+      if (v & XU64(0x80808080, 0x80808080)) break;
+    }
+    if (i >= len) break;
+    if (s[i] < 0x80) {
+      i++;
+      continue;
+    }
+    n = s[i] >= 0xf0 ? 3 : s[i] >= 0xe0 ? 2 : 1;  // Continuation bytes
+    if (s[i] < 0xc2 || s[i] > 0xf4 || i + n >= len) return false;
+    for (k = 1; k <= n; k++) {
+      if ((s[i + k] & 0xc0) != 0x80) return false;
+    }
+    if ((s[i] == 0xe0 && s[i + 1] < 0xa0) ||  // Overlong
+        (s[i] == 0xed && s[i + 1] > 0x9f) ||  // Surrogate
+        (s[i] == 0xf0 && s[i + 1] < 0x90) ||  // Overlong
+        (s[i] == 0xf4 && s[i + 1] > 0x8f)) {  // Above U+10FFFF
+      return false;
+    }
+    i += n + 1;
+  }
+  return true;
+}
+
+// Base64 decoding table: 0..63, 64 for '=', -1 for invalid characters
+static const signed char xb64_unmap[128] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, 64, -1, -1,
+    -1, 0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+};
+
 int xb64_decode_single(int c);
 int xb64_decode_single(int c) {
-  if (c >= 'A' && c <= 'Z') {
-    return c - 'A';
-  } else if (c >= 'a' && c <= 'z') {
-    return c + 26 - 'a';
-  } else if (c >= '0' && c <= '9') {
-    return c + 52 - '0';
-  } else if (c == '+') {
-    return 62;
-  } else if (c == '/') {
-    return 63;
-  } else if (c == '=') {
-    return 64;
-  } else {
-    return -1;
+  return c >= 0 && c < 128 ? xb64_unmap[c] : -1;
+}
+
+#if defined(__SSSE3__) && !defined(STR_NO_SIMD)
+// Decode 16 characters at `src` into 12 bytes at `dst`, and 4 bytes of
+// garbage after them. Return 0 if there is '=' or an invalid character
+static int xb64_decode16(const char *src, char *dst) {
+  // Per low nibble: a bit mask of valid high nibbles
+  const __m128i valid = _mm_setr_epi8(
+      (char) 0xa8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8,
+      (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8,
+      (char) 0xf0, 0x54, 0x50, 0x50, 0x50, 0x54);
+  const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char) 0x80, 0, 0,
+                                     0, 0, 0, 0, 0, 0);
+  // Per high nibble: an offset from the character to its value
+  const __m128i shift =
+      _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  __m128i x = _mm_loadu_si128((const __m128i *) src), f = _mm_set1_epi8(0x0f);
+  __m128i hi = _mm_and_si128(_mm_srli_epi32(x, 4), f), lo = _mm_and_si128(x, f);
+  __m128i slash = _mm_cmpeq_epi8(x, _mm_set1_epi8('/'));
+  __m128i ok = _mm_and_si128(_mm_shuffle_epi8(valid, lo),
+                             _mm_shuffle_epi8(bits, hi));
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(ok, _mm_setzero_si128())) != 0) {
+    return 0;
   }
+  f = _mm_shuffle_epi8(shift, hi);  // '/' differs from the rest of its range
+  f = _mm_or_si128(_mm_andnot_si128(slash, f),
+                   _mm_and_si128(slash, _mm_set1_epi8(16)));
+  x = _mm_add_epi8(x, f);
+  // Merge 4 6-bit values into 3 bytes, then pack them together
+  x = _mm_maddubs_epi16(x, _mm_set1_epi32(0x01400140));
+  x = _mm_madd_epi16(x, _mm_set1_epi32(0x00011000));
+  x = _mm_shuffle_epi8(x, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                        -1, -1, -1, -1));
+  _mm_storeu_si128((__m128i *) dst, x);
+  return 1;
 }
+#endif
 
 size_t xb64_decode(const char *src, size_t slen, char *dst, size_t dlen) {
   const char *end = src == NULL ? NULL : src + slen;  // Cannot add to NULL
   size_t len = 0;
   if (dlen < slen / 4 * 3 + 1) goto fail;
+#if defined(__SSSE3__) && !defined(STR_NO_SIMD)
+  while (src != NULL && src + 16 <= end && len + 16 <= dlen &&
+         xb64_decode16(src, dst + len)) {
+    src += 16, len += 12;
+  }
+#endif
   while (src != NULL && src + 3 < end) {
     int a = xb64_decode_single(src[0]), b = xb64_decode_single(src[1]),
         c = xb64_decode_single(src[2]), d = xb64_decode_single(src[3]);
@@ -669,6 +3002,59 @@ fail:
   return 0;
 }
 
+#define XB64_PAD 0x80  // Decoder: padding seen, only padding may follow
+
+int xb64_decode_feed(struct xb64 *ctx, const char *src, size_t slen,
+                     char *dst, size_t dlen) {
+  size_t i = 0, len = 0;
+  while (i < slen) {
+    int c, v;
+    if (ctx->n == 0 && !(ctx->flags & XB64_PAD)) {  // Fast path: whole quads
+#if defined(__SSSE3__) && !defined(STR_NO_SIMD)
+      while (i + 16 <= slen && len + 16 <= dlen &&
+             xb64_decode16(src + i, dst + len)) {
+        i += 16, len += 12;
+      }
+#endif
+      while (i + 4 <= slen && len + 3 <= dlen) {
+        const char *p = src + i;
+        int a = xb64_decode_single(p[0]), b = xb64_decode_single(p[1]);
+        int d = xb64_decode_single(p[2]), e = xb64_decode_single(p[3]);
+        if ((a | b | d | e) & ~63) break;  // Padding, whitespace, or invalid
+        dst[len++] = (char) ((a << 2) | (b >> 4));
+        dst[len++] = (char) ((b << 4) | (d >> 2));
+        dst[len++] = (char) ((d << 6) | e);
+        i += 4;
+      }
+      if (i >= slen) break;
+    }
+    c = (unsigned char) src[i++], v = xb64_decode_single(c);
+    if ((ctx->flags & XB64_SKIP_SPACE) &&
+        (c == ' ' || c == '\t' || c == '\r' || c == '\n')) {
+      continue;
+    } else if (v < 0 || (v < 64 && (ctx->flags & XB64_PAD))) {
+      return -1;
+    } else if (v == 64) {
+      if (ctx->n < 2) return -1;  // Padding must follow 2 or 3 characters
+      ctx->flags |= XB64_PAD, ctx->n = (uint8_t) ((ctx->n + 1) & 3);
+      continue;
+    }
+    ctx->bits = ctx->bits << 6 | (uint32_t) v;
+    ctx->n = (uint8_t) ((ctx->n + 1) & 3);
+    if (ctx->n == 1) continue;  // Less than 8 bits so far
+    if (len >= dlen) return -1;
+    dst[len++] = (char) (ctx->bits >> (ctx->n == 2 ? 4 : ctx->n == 3 ? 2 : 0));
+    if (ctx->n == 0) ctx->bits = 0;
+  }
+  return (int) len;
+}
+
+int xb64_decode_end(struct xb64 *ctx) {
+  int ok = ctx->n != 1 && (ctx->n == 0 || !(ctx->flags & XB64_PAD));
+  xb64_init(ctx, ctx->flags & XB64_SKIP_SPACE);
+  return ok ? 0 : -1;
+}
+
 int json_get_num(const char *buf, int len, const char *path, double *v) {
   int found = 0, n = 0, off = json_get(buf, len, path, &n);
   if (off >= 0 && (buf[off] == '-' || (buf[off] >= '0' && buf[off] <= '9'))) {
@@ -696,6 +3082,26 @@ int json_get_str(const char *buf, int len, const char *path, char *dst,
   return result;
 }
 
+// Point `val` to the string at `path` in `buf`, without quotes. Return 0 if
+// it has no escapes, 1 if it must be unescaped, or a negative value on error
+int json_get_xstr(const char *buf, int len, const char *path,
+                  struct xstr *val) {
+  int n = 0, off = json_get(buf, len, path, &n);
+  if (off < 0 || n < 2 || buf[off] != '"') return -1;
+  val->buf = (char *) buf + off + 1, val->len = (size_t) (n - 2);
+  return json_pass_plain(val->buf, 0, n - 2) < n - 2;
+}
+
+// Unescape `str` in place, starting from the first backslash
+int json_unescape_xstr(struct xstr *str) {
+  int r, n = json_pass_plain(str->buf, 0, (int) str->len);
+  size_t len = str->len - (size_t) n;
+  if (len == 0) return n;
+  if ((r = json_unescape(str->buf + n, len, str->buf + n, len)) < 0) return r;
+  str->len = (size_t) (n + r);
+  return n + r;
+}
+
 int json_get_b64(const char *buf, int len, const char *path, char *dst,
                  size_t dlen) {
   int result = -1, n = 0, off = json_get(buf, len, path, &n);
@@ -705,47 +3111,107 @@ int json_get_b64(const char *buf, int len, const char *path, char *dst,
   return result;
 }
 
+int json_get_u64(const char *buf, int len, const char *path, uint64_t *v) {
+  int n = 0, off = json_get(buf, len, path, &n);
+  uint64_t x;
+  if (off < 0 || !xatou(buf + off, n, &x)) return 0;
+  if (v != NULL) *v = x;
+  return 1;
+}
+
+int json_get_i64(const char *buf, int len, const char *path, int64_t *v) {
+  int n = 0, off = json_get(buf, len, path, &n), neg;
+  uint64_t x;
+  if (off < 0) return 0;
+  neg = buf[off] == '-';
+  if (!xatou(buf + off + neg, n - neg, &x)) return 0;
+  if (x > (neg ? XU64(0x80000000, 0) : XU64(0x7fffffff, 0xffffffff))) return 0;
+  if (v != NULL) *v = neg && x > 0 ? -(int64_t) (x - 1) - 1 : (int64_t) x;
+  return 1;
+}
+
 long json_get_long(const char *buf, int len, const char *path, long dflt) {
+  int64_t i;
   double v;
-  if (json_get_num(buf, len, path, &v)) dflt = (long) v;
+  if (json_get_i64(buf, len, path, &i)) {
+    dflt = (long) i;
+  } else if (json_get_num(buf, len, path, &v)) {
+    dflt = (long) v;  // Fraction, exponent, or out of the int64_t range
+  }
   return dflt;
 }
 
-static char xnibble(char c) {
-  return c < 10 ? c + '0' : c + 'W';
+// Render a hex dump line of `n` <= 16 bytes at `p` into `buf`, starting
+// with the address `addr` of `digits` hex digits. Return the line length
+static size_t xhexdump_line(char *buf, const uint8_t *p, size_t n, size_t addr,
+                            int digits) {
+  const char *hex = "0123456789abcdef";
+  size_t i, k = 0;
+  while (digits-- > 0) buf[k++] = hex[(addr >> (digits * 4)) & 15];
+  buf[k++] = ' ', buf[k++] = ' ', buf[k++] = ' ';
+#if defined(__SSSE3__) && !defined(STR_NO_SIMD)
+  if (n == 16) {
+    // Spread hex pairs of 16 bytes over 48 characters, "hh hh ...". Zeroes
+    // become spaces when ORed with ' ', and hex digits do not change
+    __m128i i0 = _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1,
+                               10),
+            i1 = _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1,
+                               -1, -1, -1, -1),
+            i2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, 1, -1, 2, 3,
+                               -1, 4, 5),
+            i3 = _mm_setr_epi8(-1, 6, 7, -1, 8, 9, -1, 10, 11, -1, 12, 13, -1,
+                               14, 15, -1);
+    __m128i x = _mm_loadu_si128((const __m128i *) p), f = _mm_set1_epi8(15);
+    __m128i h = _mm_loadu_si128((const __m128i *) hex), sp = _mm_set1_epi8(' ');
+    __m128i hi = _mm_shuffle_epi8(h, _mm_and_si128(_mm_srli_epi16(x, 4), f));
+    __m128i lo = _mm_shuffle_epi8(h, _mm_and_si128(x, f));
+    __m128i a = _mm_unpacklo_epi8(hi, lo), b = _mm_unpackhi_epi8(hi, lo), m;
+    _mm_storeu_si128((__m128i *) (buf + k),
+                     _mm_or_si128(sp, _mm_shuffle_epi8(a, i0)));
+    _mm_storeu_si128((__m128i *) (buf + k + 16),
+                     _mm_or_si128(_mm_or_si128(sp, _mm_shuffle_epi8(a, i1)),
+                                  _mm_shuffle_epi8(b, i2)));
+    _mm_storeu_si128((__m128i *) (buf + k + 32),
+                     _mm_or_si128(sp, _mm_shuffle_epi8(b, i3)));
+    buf[k + 48] = buf[k + 49] = ' ';
+    // Printable characters are 0x20 to 0x7e, the rest become dots
+    m = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(0x1f)),
+                      _mm_cmplt_epi8(x, _mm_set1_epi8(0x7f)));
+    x = _mm_or_si128(_mm_and_si128(m, x),
+                     _mm_andnot_si128(m, _mm_set1_epi8('.')));
+    _mm_storeu_si128((__m128i *) (buf + k + 50), x);
+    buf[k + 66] = '\n';
+    return k + 67;
+  }
+#endif
+  for (i = 0; i < 16; i++) {
+    buf[k++] = i < n ? hex[p[i] >> 4] : ' ';
+    buf[k++] = i < n ? hex[p[i] & 15] : ' ';
+    buf[k++] = ' ';
+  }
+  buf[k++] = ' ', buf[k++] = ' ';
+  for (i = 0; i < 16; i++) {
+    buf[k++] = i >= n ? ' ' : p[i] >= ' ' && p[i] <= '~' ? (char) p[i] : '.';
+  }
+  buf[k++] = '\n';
+  return k;
 }
 
-void xhexdump(void (*fn)(char, void *), void *a, const void *buf, size_t len) {
-  const unsigned char *p = (const unsigned char *) buf;
-  char ascii[16];
-  size_t i, j, n = 0;
-  for (i = 0; i < len; i++) {
-    if ((i & 15) == 0) {
-      // Print buffered ascii chars
-      if (i > 0) {
-        fn(' ', a), fn(' ', a);
-        for (j = 0; j < sizeof(ascii); j++) fn(ascii[j], a);
-        fn('\n', a), n = 0;
-      }
-      // Print hex address, then \t
-      fn(xnibble((i >> 12) & 15), a), fn(xnibble((i >> 8) & 15), a);
-      fn(xnibble((i >> 4) & 15), a), fn('0', a);
-      fn(' ', a), fn(' ', a), fn(' ', a);
-    }
-    fn(xnibble((p[i] >> 4) & 15), a), fn(xnibble(p[i] & 15), a);
-    fn(' ', a);  // Space after hex number
-    if (p[i] >= ' ' && p[i] <= '~') {
-      ascii[n++] = (char) p[i];  // Printable
-    } else {
-      ascii[n++] = '.';  // Non-printable
-    }
-  }
-  if (n > 0) {
-    while (n < 16) fn(' ', a), fn(' ', a), fn(' ', a), ascii[n++] = ' ';
-    fn(' ', a), fn(' ', a);
-    for (j = 0; j < sizeof(ascii); j++) fn(ascii[j], a);
+void xhexdump_at(void (*fn)(char, void *), void *a, const void *buf,
+                 size_t len, size_t addr) {
+  const uint8_t *p = (const uint8_t *) buf;
+  size_t i, last = addr + (len > 0 ? len - 1 : 0);
+  int digits = last <= 0xffff ? 4 : (last >> 16 >> 16) == 0 ? 8 : 16;
+  char line[100];
+  for (i = 0; i < len; i += 16) {
+    size_t n = len - i < 16 ? len - i : 16;
+    xputs(fn, a, line, xhexdump_line(line, p + i, n, addr + i, digits));
   }
-  fn('\n', a);
+  if (len == 0) fn('\n', a);
+}
+
+void xhexdump(void (*fn)(char, void *), void *a, const void *buf, size_t len) {
+  xhexdump_at(fn, a, buf, len, 0);
 }
 
 struct xstr xstr_n(const char *s, size_t n) {
@@ -758,29 +3224,38 @@ struct xstr xstr_s(const char *s) {
   return str;
 }
 
+// Glob match with a single backtracking point: on a mismatch, only the last
+// wildcard is retried, one character further. Earlier wildcards are never
+// revisited, so the time is O(s.len * p.len) on any input. A retried `*` or
+// `#` followed by a literal character skips straight to that character
 bool xmatch(struct xstr s, struct xstr p, struct xstr *caps) {
   size_t i = 0, j = 0, ni = 0, nj = 0;
+  struct xstr *nc = caps;  // Cap of the last wildcard
   if (caps) caps->buf = NULL, caps->len = 0;
   while (i < p.len || j < s.len) {
     if (i < p.len && j < s.len &&
         (p.buf[i] == '?' ||
          (p.buf[i] != '*' && p.buf[i] != '#' && s.buf[j] == p.buf[i]))) {
-      if (caps == NULL) {
-      } else if (p.buf[i] == '?') {
-        caps->buf = &s.buf[j], caps->len = 1;     // Finalize `?` cap
-        caps++, caps->buf = NULL, caps->len = 0;  // Init next cap
-      } else if (caps->buf != NULL && caps->len == 0) {
+      if (caps != NULL && caps->buf != NULL && caps->len == 0) {
         caps->len = (size_t) (&s.buf[j] - caps->buf);  // Finalize current cap
         caps++, caps->len = 0, caps->buf = NULL;       // Init next cap
       }
+      if (caps != NULL && p.buf[i] == '?') {
+        caps->buf = &s.buf[j], caps->len = 1;     // Finalize `?` cap
+        caps++, caps->buf = NULL, caps->len = 0;  // Init next cap
+      }
       i++, j++;
     } else if (i < p.len && (p.buf[i] == '*' || p.buf[i] == '#')) {
       if (caps && !caps->buf) caps->len = 0, caps->buf = &s.buf[j];  // Init cap
-      ni = i++, nj = j + 1;
-    } else if (nj > 0 && nj <= s.len && (p.buf[ni] == '#' || s.buf[j] != '/')) {
+      nc = caps, ni = i++, nj = j + 1;
+    } else if (nj > 0 && nj <= s.len &&
+               (p.buf[ni] == '#' || s.buf[nj - 1] != '/')) {
+      char c = ni + 1 < p.len ? p.buf[ni + 1] : '?';
       i = ni, j = nj;
-      if (caps && caps->buf == NULL && caps->len == 0) {
-        caps--, caps->len = 0;  // Restart previous cap
+      if (caps) caps = nc, caps->len = 0;  // Restart the wildcard cap
+      while (c != '?' && c != '*' && c != '#' && j < s.len && s.buf[j] != c &&
+             (p.buf[ni] == '#' || s.buf[j] != '/')) {
+        j++;  // This position would fail at once, skip it
       }
     } else {
       return false;
@@ -792,6 +3267,266 @@ bool xmatch(struct xstr s, struct xstr p, struct xstr *caps) {
   return true;
 }
 
+void xroutes_init(struct xroutes *rs, struct xroute *routes, int maxroutes,
+                  struct xroute_node *nodes, int maxnodes) {
+  rs->routes = routes, rs->nroutes = 0, rs->maxroutes = maxroutes;
+  rs->nodes = nodes, rs->nnodes = maxnodes > 0 ? 1 : 0, rs->maxnodes = maxnodes;
+  if (maxnodes > 0) {
+    nodes->child = nodes->sibling = nodes->routes = -1;
+    nodes->min = 0, nodes->ch = '\0';
+  }
+}
+
+// Literal prefix of a pattern: characters up to the first wildcard
+static size_t xroutes_prefix(struct xstr p) {
+  size_t i = 0;
+  while (i < p.len && p.buf[i] != '*' && p.buf[i] != '?' && p.buf[i] != '#') {
+    i++;
+  }
+  return i;
+}
+
+// Return a child of node `node` that is reached by character `ch`, or -1
+static int xroutes_child(const struct xroutes *rs, int node, char ch) {
+  int k = rs->nodes[node].child;
+  while (k >= 0 && rs->nodes[k].ch != ch) k = rs->nodes[k].sibling;
+  return k;
+}
+
+int xroutes_add(struct xroutes *rs, struct xstr pattern) {
+  int id = rs->nroutes, node = 0, k, *r;
+  size_t i, n = xroutes_prefix(pattern);
+  if (id >= rs->maxroutes || rs->nnodes == 0) return -1;
+  for (i = 0; i < n; i++) {  // Count nodes to create
+    if ((node = xroutes_child(rs, node, pattern.buf[i])) < 0) break;
+  }
+  if ((size_t) (rs->maxnodes - rs->nnodes) < n - i) return -1;
+  for (node = 0, i = 0; i < n; i++, node = k) {
+    if ((k = xroutes_child(rs, node, pattern.buf[i])) < 0) {
+      struct xroute_node *nd = &rs->nodes[rs->nnodes];
+      nd->child = nd->routes = -1, nd->min = id, nd->ch = pattern.buf[i];
+      nd->sibling = rs->nodes[node].child;
+      k = rs->nodes[node].child = rs->nnodes++;
+    }
+  }
+  // Keep routes of a node in the order they were added
+  for (r = &rs->nodes[node].routes; *r >= 0; r = &rs->routes[*r].next) (void) 0;
+  *r = id;
+  rs->routes[id].pattern = pattern, rs->routes[id].next = -1;
+  return rs->nroutes++;
+}
+
+// Walk the trie along `s`. At each node, try routes whose literal prefix
+// ends there on the rest of `s`. Stop when the subtree holds no route added
+// before the best match so far
+int xroutes_match(const struct xroutes *rs, struct xstr s, struct xstr *caps) {
+  int best = rs->nroutes, node = 0, r;
+  size_t j = 0;
+  while (node >= 0 && rs->nnodes > 0 && rs->nodes[node].min < best) {
+    for (r = rs->nodes[node].routes; r >= 0 && r < best;
+         r = rs->routes[r].next) {
+      struct xstr p = rs->routes[r].pattern;
+      if (xmatch(xstr_n(s.buf + j, s.len - j), xstr_n(p.buf + j, p.len - j),
+                 NULL)) {
+        best = r;
+      }
+    }
+    node = j < s.len ? xroutes_child(rs, node, s.buf[j++]) : -1;
+  }
+  if (best == rs->nroutes) return -1;
+  if (caps != NULL) xmatch(s, rs->routes[best].pattern, caps);
+  return best;
+}
+
+void xtopics_init(struct xtopics *t, struct xtopic_node *nodes, int maxnodes,
+                  struct xtopic_sub *subs, int maxsubs) {
+  int i;
+  t->nodes = nodes, t->maxnodes = maxnodes, t->subs = subs;
+  for (i = 0; i < maxnodes; i++) {
+    nodes[i].bucket = nodes[i].parent = -1, nodes[i].chain = i + 1;
+  }
+  for (i = 0; i < maxsubs; i++) subs[i].next = i + 1 < maxsubs ? i + 1 : -1;
+  if (maxnodes > 0) {
+    nodes[0].plus = nodes[0].multi = nodes[0].subs = -1;
+    nodes[0].nchildren = 0, nodes[0].hash = 0;
+    nodes[0].chain = nodes[maxnodes - 1].chain = -1;
+  }
+  t->freenodes = maxnodes > 1 ? 1 : -1;
+  t->nfree = maxnodes > 1 ? maxnodes - 1 : 0;
+  t->freesubs = maxsubs > 0 ? 0 : -1;
+}
+
+// Return the end of a topic level that starts at `j`
+static size_t xtopics_end(struct xstr s, size_t j) {
+  while (j < s.len && s.buf[j] != '/') j++;
+  return j;
+}
+
+// Return 1 for a `*` level, 2 for `#`, 0 for a literal level, or -1 if a
+// level has wildcards mixed with other characters
+static int xtopics_kind(const char *s, size_t n) {
+  size_t i;
+  if (n == 1 && s[0] == '*') return 1;
+  if (n == 1 && s[0] == '#') return 2;
+  for (i = 0; i < n; i++) {
+    if (s[i] == '*' || s[i] == '#' || s[i] == '?') return -1;
+  }
+  return 0;
+}
+
+static uint32_t xtopics_hash(const char *s, size_t n) {
+  uint32_t h = 2166136261U;  // FNV-1a
+  while (n-- > 0) h = (h ^ (uint8_t) *s++) * 16777619U;
+  return h;
+}
+
+// Index of a hash bucket for the child of `parent` with level hash `h`
+static int xtopics_bucket(const struct xtopics *t, int parent, uint32_t h) {
+  return (int) ((h ^ ((uint32_t) parent * 2654435761U)) %
+                (uint32_t) t->maxnodes);
+}
+
+// Return a literal child of node `node` for level `s`, `n`, or -1. Levels
+// with the same hash share a node: xtopics_match() checks the filters
+static int xtopics_literal(const struct xtopics *t, int node, const char *s,
+                           size_t n) {
+  uint32_t h = xtopics_hash(s, n);
+  int k = t->nodes[xtopics_bucket(t, node, h)].bucket;
+  while (k >= 0 && (t->nodes[k].parent != node || t->nodes[k].hash != h)) {
+    k = t->nodes[k].chain;
+  }
+  return k;
+}
+
+// Return a child of node `node` for filter level `s`, `n`, or -1
+static int xtopics_child(const struct xtopics *t, int node, const char *s,
+                         size_t n) {
+  int kind = xtopics_kind(s, n);
+  return kind == 1   ? t->nodes[node].plus
+         : kind == 2 ? t->nodes[node].multi
+                     : xtopics_literal(t, node, s, n);
+}
+
+// Filters are split into levels by `/`. A level is either literal, or a
+// single `*`, or a single `#` at the end
+static bool xtopics_valid(struct xstr f) {
+  size_t j, e;
+  for (j = 0; j <= f.len; j = e + 1) {
+    int kind = xtopics_kind(f.buf + j, (e = xtopics_end(f, j)) - j);
+    if (kind < 0 || (kind == 2 && e < f.len)) return false;
+  }
+  return true;
+}
+
+int xtopics_add(struct xtopics *t, struct xstr f, int id) {
+  int node = 0, k, sub = t->freesubs, missing = 0;
+  size_t j, e;
+  if (sub < 0 || t->maxnodes == 0 || !xtopics_valid(f)) return -1;
+  for (j = 0; j <= f.len; j = e + 1) {  // Count nodes to create
+    e = xtopics_end(f, j);
+    if (missing > 0 || (node = xtopics_child(t, node, f.buf + j, e - j)) < 0) {
+      missing++;
+    }
+  }
+  if (missing > t->nfree) return -1;
+  for (node = 0, j = 0; j <= f.len; j = e + 1, node = k) {
+    e = xtopics_end(f, j);
+    if ((k = xtopics_child(t, node, f.buf + j, e - j)) < 0) {
+      struct xtopic_node *nd = &t->nodes[k = t->freenodes];
+      int kind = xtopics_kind(f.buf + j, e - j);
+      t->freenodes = nd->chain, t->nfree--;
+      nd->hash = xtopics_hash(f.buf + j, e - j), nd->parent = node;
+      nd->plus = nd->multi = nd->subs = nd->chain = -1, nd->nchildren = 0;
+      if (kind == 1) {
+        t->nodes[node].plus = k;
+      } else if (kind == 2) {
+        t->nodes[node].multi = k;
+      } else {
+        int b = xtopics_bucket(t, node, nd->hash);
+        nd->chain = t->nodes[b].bucket, t->nodes[b].bucket = k;
+      }
+      t->nodes[node].nchildren++;
+    }
+  }
+  t->freesubs = t->subs[sub].next;
+  t->subs[sub].filter = f, t->subs[sub].id = id;
+  t->subs[sub].next = t->nodes[node].subs, t->nodes[node].subs = sub;
+  return 0;
+}
+
+int xtopics_del(struct xtopics *t, struct xstr f, int id) {
+  int node = 0, *p;
+  size_t j, e;
+  if (t->maxnodes == 0 || !xtopics_valid(f)) return -1;
+  for (j = 0; j <= f.len && node >= 0; j = e + 1) {
+    e = xtopics_end(f, j);
+    node = xtopics_child(t, node, f.buf + j, e - j);
+  }
+  if (node < 0) return -1;
+  for (p = &t->nodes[node].subs; *p >= 0; p = &t->subs[*p].next) {
+    struct xtopic_sub *sub = &t->subs[*p];
+    if (sub->id == id && sub->filter.len == f.len &&
+        memcmp(sub->filter.buf, f.buf, f.len) == 0) {
+      break;
+    }
+  }
+  if (*p < 0) return -1;
+  j = (size_t) *p, *p = t->subs[j].next;
+  t->subs[j].next = t->freesubs, t->freesubs = (int) j;
+  // Free nodes that are left without subscriptions and children
+  while (node > 0 && t->nodes[node].subs < 0 && t->nodes[node].nchildren == 0) {
+    struct xtopic_node *nd = &t->nodes[node], *parent = &t->nodes[nd->parent];
+    if (parent->plus == node) {
+      parent->plus = -1;
+    } else if (parent->multi == node) {
+      parent->multi = -1;
+    } else {
+      for (p = &t->nodes[xtopics_bucket(t, nd->parent, nd->hash)].bucket;
+           *p != node; p = &t->nodes[*p].chain) {
+      }
+      *p = nd->chain;
+    }
+    parent->nchildren--;
+    nd->parent = -1, nd->chain = t->freenodes, t->freenodes = node, t->nfree++;
+    node = (int) (parent - t->nodes);
+  }
+  return 0;
+}
+
+// Add subscribers of node `node` whose filters match `topic` to `ids`
+static int xtopics_collect(const struct xtopics *t, int node,
+                           struct xstr topic, int *ids, int maxids, int n) {
+  int k;
+  for (k = t->nodes[node].subs; k >= 0; k = t->subs[k].next) {
+    if (!xmatch(topic, t->subs[k].filter, NULL)) continue;
+    if (n < maxids) ids[n] = t->subs[k].id;
+    n++;
+  }
+  return n;
+}
+
+// Match levels of `topic` from `j` onwards against the subtree of `node`.
+// Recursion depth is limited by the number of levels in filters
+static int xtopics_walk(const struct xtopics *t, int node, struct xstr topic,
+                        size_t j, int *ids, int maxids, int n) {
+  const struct xtopic_node *nd = &t->nodes[node];
+  size_t e;
+  int k;
+  if (j > topic.len) return xtopics_collect(t, node, topic, ids, maxids, n);
+  e = xtopics_end(topic, j);
+  if ((k = nd->multi) >= 0) n = xtopics_collect(t, k, topic, ids, maxids, n);
+  if ((k = nd->plus) >= 0) n = xtopics_walk(t, k, topic, e + 1, ids, maxids, n);
+  if ((k = xtopics_literal(t, node, topic.buf + j, e - j)) >= 0) {
+    n = xtopics_walk(t, k, topic, e + 1, ids, maxids, n);
+  }
+  return n;
+}
+
+int xtopics_match(const struct xtopics *t, struct xstr topic, int *ids,
+                  int maxids) {
+  return t->maxnodes > 0 ? xtopics_walk(t, 0, topic, 0, ids, maxids, 0) : 0;
+}
+
 #endif  // STR_API_ONLY
 
 #ifdef __cplusplus
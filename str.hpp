@@ -0,0 +1,368 @@
+// Copyright (c) 2023 Cesanta Software Limited
+// SPDX-License-Identifier: AGPL-3.0 or commercial
+
+// C++17 companion to str.h: type-safe printing. The format string is parsed
+// and checked against the argument types at compile time, and every argument
+// is printed by a function chosen by its type, without va_list:
+//
+//   str::xsnprintf(buf, sizeof(buf), XFMT("%s: %d"), name, 42);
+
+#ifndef STR_HPP_
+#define STR_HPP_
+
+#if !(defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) && __cplusplus < 201703L
+#error "str.hpp requires C++17"
+#endif
+
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "str.h"
+
+// A format string checked at compile time: a type that carries the string
+#define XFMT(s)                                             \
+  [] {                                                      \
+    struct S {                                              \
+      static constexpr std::string_view get() { return s; } \
+    };                                                      \
+    return S();                                             \
+  }()
+
+namespace str {
+
+// Argument of %M, %m: a format function and its arguments
+template <class... A>
+struct fn_arg {
+  size_t (*fn)(void (*)(char, void *), void *, va_list *);
+  std::tuple<A...> args;
+};
+
+template <class... A>
+inline fn_arg<A...> fn(size_t (*f)(void (*)(char, void *), void *, va_list *),
+                       A... args) {
+  return {f, std::tuple<A...>(args...)};
+}
+
+namespace impl {
+
+// Argument kinds, and conversions that accept them
+enum { INT = 1, DBL = 2, STR = 4, CHR = 8, PTR = 16, FN = 32 };
+enum { OK, BADCONV, BADTYPE, FEW, MANY };
+
+template <class T>
+struct is_fn : std::false_type {};
+template <class... A>
+struct is_fn<fn_arg<A...>> : std::true_type {};
+
+template <class T>
+constexpr unsigned kinds() {
+  using U = std::decay_t<T>;
+  if constexpr (is_fn<U>::value) {
+    return FN;
+  } else if constexpr (std::is_same_v<U, bool>) {
+    return 0;
+  } else if constexpr (std::is_integral_v<U>) {
+    return INT | DBL | CHR;
+  } else if constexpr (std::is_floating_point_v<U>) {
+    return DBL;
+  } else if constexpr (std::is_convertible_v<const T &, const char *>) {
+    return STR | PTR;
+  } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+    return STR;
+  } else if constexpr (std::is_pointer_v<U>) {
+    return PTR;
+  } else {
+    return 0;
+  }
+}
+
+constexpr unsigned conv_kind(char c) {
+  if (c == 'd' || c == 'u' || c == 'x' || c == 'X') return INT;
+#if !defined(NO_FLOAT)
+  if (c == 'g' || c == 'f') return DBL;
+#endif
+  if (c == 's') return STR;
+  if (c == 'c') return CHR;
+  if (c == 'p') return PTR;
+  if (c == 'm' || c == 'M') return FN;
+  return 0;
+}
+
+constexpr bool digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+// Parse a literal run or a conversion at `f[i]` into `op`, like xfmt_parse().
+// %% becomes a literal run. Return the index of the rest of the format
+constexpr size_t parse(std::string_view f, size_t i, xfmt_op &op) {
+  size_t n = f.size();
+  char c = 0;
+  op = xfmt_op{};
+  if (f[i] != '%') {
+    while (i + op.len < n && f[i + op.len] != '%') op.len++;
+    op.str = f.data() + i;
+    return i + op.len;
+  }
+  op.pad = ' ', op.prec = ~0U;
+  if (++i < n) c = f[i];
+  if (c == '#') op.alt++, c = ++i < n ? f[i] : 0;
+  if (c == '-') op.minus++, c = ++i < n ? f[i] : 0;
+  if (c == '0') op.pad = '0', c = ++i < n ? f[i] : 0;
+  while (digit(c)) {
+    op.width = op.width * 10 + unsigned(c - '0'), c = ++i < n ? f[i] : 0;
+  }
+  if (c == '.') {
+    c = ++i < n ? f[i] : 0;
+    if (c == '*') {
+      op.star = 1, c = ++i < n ? f[i] : 0;
+    } else {
+      op.prec = 0;
+      while (digit(c)) {
+        op.prec = op.prec * 10 + unsigned(c - '0'), c = ++i < n ? f[i] : 0;
+      }
+    }
+  }
+  while (c == 'h') c = ++i < n ? f[i] : 0;
+  if (c == 'l') {
+    op.lng++, c = ++i < n ? f[i] : 0;
+    if (c == 'l') op.lng++, c = ++i < n ? f[i] : 0;
+  }
+  if (c == 'p') op.alt = 1, op.lng = 1;
+  op.conv = c;
+  if (c == '%') op.str = f.data() + i, op.len = 1;
+  return i < n ? i + 1 : n;
+}
+
+constexpr size_t count(std::string_view f) {
+  xfmt_op op{};
+  size_t i = 0, n = 0;
+  while (i < f.size()) i = parse(f, i, op), n++;
+  return n;
+}
+
+// Compiled format: ops, and the index of the first argument of each op
+template <size_t N>
+struct table {
+  xfmt_op op[N];
+  size_t arg[N];
+  size_t nops, nargs;
+};
+
+template <size_t N>
+constexpr table<N> compile(std::string_view f) {
+  table<N> t{};
+  size_t i = 0;
+  while (i < f.size()) {
+    xfmt_op &op = t.op[t.nops];
+    i = parse(f, i, op);
+    t.arg[t.nops++] = t.nargs;
+    if (op.str == nullptr) t.nargs += op.star ? 2 : 1;
+  }
+  return t;
+}
+
+template <class F>
+struct compiled {
+  static constexpr size_t n = count(F::get());
+  static constexpr table<n + 1> value = compile<n + 1>(F::get());
+};
+
+template <class F, class... A>
+constexpr int check() {
+  constexpr auto &t = compiled<F>::value;
+  const unsigned k[] = {kinds<A>()..., 0};
+  for (size_t i = 0; i < t.nops; i++) {
+    const xfmt_op &op = t.op[i];
+    size_t a = t.arg[i];
+    if (op.str != nullptr) continue;
+    if (conv_kind(op.conv) == 0) return BADCONV;
+    if (a + op.star >= sizeof...(A)) return FEW;
+    if (op.star && !(k[a] & INT)) return BADTYPE;
+    if (!(k[a + op.star] & conv_kind(op.conv))) return BADTYPE;
+  }
+  return t.nargs < sizeof...(A) ? MANY : OK;
+}
+
+// Output to a buffer: count everything, store what fits
+struct obuf {
+  char *buf;
+  size_t size, len;
+  void put(const char *s, size_t n) {
+    if (len < size) memcpy(buf + len, s, n < size - len ? n : size - len);
+    len += n;
+  }
+  void pad(char c, size_t n) {
+    if (len < size) memset(buf + len, c, n < size - len ? n : size - len);
+    len += n;
+  }
+};
+
+// Output to a function that takes one character
+struct ofn {
+  void (*fn)(char, void *);
+  void *param;
+  size_t len;
+  void put(const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) fn(s[i], param);
+    len += n;
+  }
+  void pad(char c, size_t n) {
+    for (size_t i = 0; i < n; i++) fn(c, param);
+    len += n;
+  }
+};
+
+template <class O>
+void xout(char c, void *o) {
+  static_cast<O *>(o)->put(&c, 1);
+}
+
+// Print a number of `k` bytes at `s` with padding, like xfmt_exec()
+template <class O>
+inline void put_num(O &o, const xfmt_op &op, const char *s, size_t k) {
+  size_t w = op.width, x = op.alt ? 2 : 0;
+  w -= x < w ? x : w;
+  if (op.pad == ' ' && !op.minus && k < w) o.pad(' ', w - k);
+  if (x > 0) o.put("0x", 2);
+  if (op.pad == '0' && k < w) o.pad('0', w - k);
+  o.put(s, k);
+  if (op.pad == ' ' && op.minus && k < w) o.pad(' ', w - k);
+}
+
+// Print `n` bytes of a string with precision `pr`, which sets the padding
+template <class O>
+inline void put_str(O &o, const xfmt_op &op, size_t pr, const char *s,
+                    size_t n) {
+  if (!op.minus && pr < op.width) o.pad(op.pad, op.width - pr);
+  o.put(s, n);
+  if (op.minus && pr < op.width) o.pad(op.pad, op.width - pr);
+}
+
+#if !defined(NO_FLOAT)
+template <class O>
+inline void put_dbl(O &o, const xfmt_op &op, size_t pr, double v) {
+  char tmp[40];
+  int prec = pr == ~0U ? 6 : int(pr);
+  size_t k = xdtoa(tmp, sizeof(tmp), v, prec, op.conv);
+  if (k < sizeof(tmp)) {
+    put_num(o, op, tmp, k);
+  } else {  // Too long for tmp, let the C version print it
+    xfmt_op m = op;
+    m.star = 0, m.prec = unsigned(pr);
+    xprintfc(xout<O>, &o, &m, 1, v);
+  }
+}
+#endif
+
+// Print argument `v` of conversion `op` with precision `pr`
+template <class O, class T>
+inline void put(O &o, const xfmt_op &op, size_t pr, const T &v) {
+  using U = std::decay_t<T>;
+  char tmp[40], c = op.conv;
+  if constexpr (is_fn<U>::value) {
+    xfmt_op m = op;
+    m.star = 0, m.prec = unsigned(pr);
+    std::apply(
+        [&](const auto &...a) { xprintfc(xout<O>, &o, &m, 1, v.fn, a...); },
+        v.args);
+  } else if constexpr (std::is_integral_v<U>) {
+    using P = decltype(+v);  // Promoted like a variadic argument
+    if (c == 'c') {
+      tmp[0] = char(v), o.put(tmp, 1);
+#if !defined(NO_FLOAT)
+    } else if (c == 'g' || c == 'f') {
+      put_dbl(o, op, pr, double(v));
+#endif
+    } else if (c == 'd') {
+      put_num(o, op, tmp, xlld(tmp, int64_t(v), 1, 0));
+    } else {
+      int64_t u = int64_t(std::make_unsigned_t<P>(v));
+      put_num(o, op, tmp, xlld(tmp, u, 0, c != 'u'));
+    }
+  } else if constexpr (std::is_floating_point_v<U>) {
+#if !defined(NO_FLOAT)
+    put_dbl(o, op, pr, double(v));
+#endif
+  } else if constexpr (std::is_convertible_v<const T &, const char *>) {
+    const char *s = v;
+    const void *e;
+    size_t n = pr;
+    if (c == 'p') {
+      int64_t p = int64_t(reinterpret_cast<uintptr_t>(s));
+      put_num(o, op, tmp, xlld(tmp, p, 0, 1));
+    } else if (s == nullptr) {
+      put_str(o, op, pr == ~0U ? 0 : pr, "", 0);
+    } else if (pr == ~0U) {
+      pr = strlen(s), put_str(o, op, pr, s, pr);
+    } else {
+      e = memchr(s, 0, pr);
+      if (e != nullptr) n = size_t(static_cast<const char *>(e) - s);
+      put_str(o, op, pr, s, n);
+    }
+  } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+    std::string_view s = v;
+    if (pr == ~0U) pr = s.size();
+    put_str(o, op, pr, s.data(), pr < s.size() ? pr : s.size());
+  } else {
+    int64_t p = int64_t(reinterpret_cast<uintptr_t>(v));
+    put_num(o, op, tmp, xlld(tmp, p, 0, 1));
+  }
+}
+
+template <class F, size_t I, class O, class T>
+inline void emit(O &o, const T &args) {
+  constexpr auto &t = compiled<F>::value;
+  constexpr size_t a = t.arg[I];
+  if constexpr (t.op[I].str != nullptr) {
+    o.put(t.op[I].str, t.op[I].len);
+  } else if constexpr (t.op[I].star) {
+    size_t pr = size_t(int(std::get<a>(args)));
+    put(o, t.op[I], pr, std::get<a + 1>(args));
+  } else {
+    put(o, t.op[I], t.op[I].prec, std::get<a>(args));
+  }
+}
+
+template <class F, class O, class... A, size_t... I>
+inline void run(O &o, std::index_sequence<I...>, const A &...args) {
+  const std::tuple<const A &...> t(args...);
+  (emit<F, I>(o, t), ...);
+  (void) t;
+}
+
+template <class F, class O, class... A>
+inline void print(O &o, const A &...args) {
+  constexpr int e = check<F, A...>();
+  static_assert(e != BADCONV, "str: unknown conversion specifier");
+  static_assert(e != BADTYPE, "str: wrong argument type");
+  static_assert(e != FEW, "str: too few arguments");
+  static_assert(e != MANY, "str: too many arguments");
+  if constexpr (e == OK) {
+    run<F>(o, std::make_index_sequence<compiled<F>::n>(), args...);
+  }
+}
+
+}  // namespace impl
+
+// Same as xprintf() and xsnprintf(), with the format made by XFMT()
+template <class F, class... A>
+inline size_t xprintf(void (*fn)(char, void *), void *param, F,
+                      const A &...args) {
+  impl::ofn o = {fn, param, 0};
+  impl::print<F>(o, args...);
+  return o.len;
+}
+
+template <class F, class... A>
+inline size_t xsnprintf(char *buf, size_t len, F, const A &...args) {
+  impl::obuf o = {buf, len, 0};
+  impl::print<F>(o, args...);
+  if (len > 0) buf[o.len < len ? o.len : len - 1] = '\0';  // NUL terminate
+  return o.len;
+}
+
+}  // namespace str
+
+#endif  // STR_HPP_
@@ -0,0 +1,585 @@
+// Copyright (c) 2023 Cesanta Software Limited
+// All rights reserved
+
+#include <stdio.h>   // printf
+#include <stdlib.h>  // strtod, malloc
+#include <string.h>  // strlen
+#include <time.h>    // clock
+
+#include "str.h"
+
+#if defined(STR_POSIX)
+#include <fcntl.h>   // open
+#include <unistd.h>  // write, close
+#endif
+
+#if defined(__cplusplus) && __cplusplus >= 201703L
+#include <cstdio>  // std::snprintf
+#include "str.hpp"
+#endif
+
+static size_t N = 1000000;  // Iterations per benchmark
+static char s_buf[200];
+static struct xbuf s_mb = {s_buf, sizeof(s_buf), 0};
+static volatile size_t s_sink;  // Prevents the compiler from dropping calls
+
+static double now(void) {
+  return (double) clock() / CLOCKS_PER_SEC;
+}
+
+#define BENCH(name_, expr_)                                        \
+  do {                                                             \
+    size_t i_;                                                     \
+    double t_ = now();                                             \
+    for (i_ = 0; i_ < N; i_++) s_mb.len = 0, s_sink += (expr_);    \
+    t_ = (now() - t_) * 1e9 / (double) N;                          \
+    printf("  %-44s %8.1f ns\n", name_, t_);                       \
+  } while (0)
+
+#define BENCH_FMT(fmt_, ...)                                            \
+  do {                                                                  \
+    struct xfmt_op ops_[20];                                            \
+    size_t n_ = xfmt_compile(fmt_, ops_, sizeof(ops_) / sizeof(*ops_)); \
+    printf("%s\n", fmt_);                                               \
+    BENCH("xprintf", xprintf(xout_buf, &s_mb, fmt_, __VA_ARGS__));      \
+    BENCH("xprintfc", xprintfc(xout_buf, &s_mb, ops_, n_, __VA_ARGS__));  \
+  } while (0)
+
+static void bench_compiled(void) {
+  uint32_t ip4 = 0x0100007f;
+  printf("Precompiled format strings\n");
+  BENCH_FMT("%s: %g", "dbl", 1.234);
+  BENCH_FMT("%d %5s", 7, "pad");
+  BENCH_FMT("%#04x %-4d|%04x|%.*s", 11, 7, 10, 3, "foobar");
+  BENCH_FMT("JSON: {%m: %d}", XESC("value"), 1234);
+  BENCH_FMT("_%M_%d", fmt_ip4, &ip4, 123);
+}
+
+static void bench_esc(void) {
+  static char buf[4096], payload[1024];
+  size_t i;
+  for (i = 0; i < sizeof(payload) - 1; i++) {
+    payload[i] = (char) ('a' + i % 26);
+    if (i % 50 == 49) payload[i] = '"';
+    if (i % 80 == 79) payload[i] = '\n';
+  }
+  printf("Escaping %lu bytes, a quote or a newline every 50 bytes\n",
+         (unsigned long) (sizeof(payload) - 1));
+  BENCH("xsnprintf %m XESC",
+        xsnprintf(buf, sizeof(buf), "%m", XESC(payload)));
+}
+
+// Decode `n` bytes of base64 from `enc`, fed line by line as it arrives
+static size_t b64_lines(const char *enc, size_t n, char *dec) {
+  struct xb64 ctx;
+  size_t i, k, len = 0;
+  xb64_init(&ctx, 0);
+  for (i = 0; i < n; i += k) {
+    k = n - i < 76 ? n - i : 76;
+    len += (size_t) xb64_decode_feed(&ctx, enc + i, k, dec + len, 60);
+  }
+  return len + (size_t) xb64_decode_end(&ctx);
+}
+
+static void bench_b64(void) {
+  static char raw[3072], enc[4200], dec[3100];
+  size_t i, n;
+  for (i = 0; i < sizeof(raw); i++) raw[i] = (char) (i * 7 + i / 256);
+  n = xsnprintf(enc, sizeof(enc), "%M", fmt_b64, (int) sizeof(raw), raw);
+  printf("Base64, %lu bytes raw, %lu bytes encoded\n",
+         (unsigned long) sizeof(raw), (unsigned long) n);
+  BENCH("xsnprintf %M fmt_b64", xsnprintf(enc, sizeof(enc), "%M", fmt_b64,
+                                          (int) sizeof(raw), raw));
+  BENCH("xb64_decode", xb64_decode(enc, n, dec, sizeof(dec)));
+  BENCH("xb64_decode_feed, 76 byte lines", b64_lines(enc, n, dec));
+}
+
+static void discard(char c, void *param) {
+  s_sink += (size_t) c, (void) param;
+}
+
+static void bench_hexdump(void) {
+  static char data[1024];
+  size_t i, saved = N;
+  for (i = 0; i < sizeof(data); i++) data[i] = (char) (i * 7);
+  printf("Hex dump of %lu bytes\n", (unsigned long) sizeof(data));
+  N = 10000;
+  BENCH("xhexdump, character output", (xhexdump(discard, 0, data, 1024), 0));
+  BENCH("xhexdump, buffer output", (xhexdump(xout_buf, &s_mb, data, 1024), 0));
+  N = saved;
+}
+
+#define DBUF_FMT "{\"id\": %lu, \"name\": %m, \"loc\": [%g, %g], \"ok\": %s}"
+#define DBUF_ARGS(i_)                              \
+  (unsigned long) (i_), XESC(s_name), 51.5072, -0.1276, \
+      (i_) & 1 ? "true" : "false"
+static const char *s_name = "sensor 7, \"west\" wing, second floor, rack 12";
+
+static void *heap(void *ptr, size_t oldsize, size_t size, void *param) {
+  (void) oldsize, (void) param;
+  if (size > 0) return realloc(ptr, size);
+  free(ptr);
+  return NULL;
+}
+
+// Measure, allocate, then print again
+static size_t dbuf_two_pass(size_t i) {
+  size_t n = xsnprintf(NULL, 0, DBUF_FMT, DBUF_ARGS(i));
+  char *p = (char *) malloc(n + 1);
+  if (p != NULL) xsnprintf(p, n + 1, DBUF_FMT, DBUF_ARGS(i)), n += (size_t) *p;
+  free(p);
+  return n;
+}
+
+static size_t dbuf_heap(size_t i) {
+  struct xdbuf db;
+  char *p;
+  size_t n;
+  xdbuf_init(&db, heap, NULL);
+  n = xprintf(xout_dbuf, &db, DBUF_FMT, DBUF_ARGS(i));
+  if ((p = xdbuf_done(&db)) != NULL) n += (size_t) *p;
+  free(p);
+  return n;
+}
+
+static size_t dbuf_arena(size_t i) {
+  static char mem[1024];
+  struct xarena arena = {mem, sizeof(mem), 0};
+  struct xdbuf db;
+  char *p;
+  size_t n;
+  xdbuf_init(&db, xarena_alloc, &arena);
+  n = xprintf(xout_dbuf, &db, DBUF_FMT, DBUF_ARGS(i));
+  if ((p = xdbuf_done(&db)) != NULL) n += (size_t) *p;
+  return n;
+}
+
+static void bench_dbuf(void) {
+  printf("Printing to dynamic memory: %s\n", DBUF_FMT);
+  BENCH("xsnprintf twice, malloc", dbuf_two_pass(i_));
+  BENCH("xdbuf, realloc", dbuf_heap(i_));
+  BENCH("xdbuf, arena", dbuf_arena(i_));
+}
+
+#define XLOG_FMT "%s: temp %g, rpm %d, state %s\n"
+#define XLOG_ARGS(i_) "pump 3", 21.5 + (double) (i_ % 10), (int) i_, "running"
+static char s_ring[64 * 1024];
+static struct xlog s_log;
+
+static size_t xlog_capture(size_t i) {
+  if (xlog_printf(&s_log, XLOG_FMT, XLOG_ARGS(i))) return 1;
+  s_log.head = s_log.tail = 0;  // Full: drop everything, keep measuring
+  return 0;
+}
+
+// Capture and format right away: the total cost, now paid by the consumer
+static size_t xlog_roundtrip(size_t i) {
+  xlog_printf(&s_log, XLOG_FMT, XLOG_ARGS(i));
+  return xlog_flush(&s_log, discard, NULL);
+}
+
+static void bench_xlog(void) {
+  printf("Deferred logging: %s", XLOG_FMT);
+  xlog_init(&s_log, s_ring, sizeof(s_ring), 0);
+  BENCH("xsnprintf", xsnprintf(s_buf, sizeof(s_buf), XLOG_FMT, XLOG_ARGS(i_)));
+  BENCH("xlog_printf", xlog_capture(i_));
+  BENCH("xlog_printf, then xlog_flush", xlog_roundtrip(i_));
+  xlog_init(&s_log, s_ring, sizeof(s_ring), XLOG_REF_STR);
+  BENCH("xlog_printf, XLOG_REF_STR", xlog_capture(i_));
+}
+
+#if defined(STR_POSIX)
+static int s_fd;
+static char s_xsink_mem[16 * 1024];
+static struct xflush s_fl;
+static struct xsink s_xsink;
+
+// A line at a time: format into a buffer, then write() it
+static size_t sink_write(size_t i) {
+  size_t n = xsnprintf(s_buf, sizeof(s_buf), XLOG_FMT, XLOG_ARGS(i));
+  return (size_t) write(s_fd, s_buf, n);
+}
+
+static size_t sink_batch(size_t i) {
+  size_t n = xprintf(xout_sink, &s_xsink, XLOG_FMT, XLOG_ARGS(i));
+  return n + xflush_poll(&s_fl, 0);
+}
+
+static void bench_sink(void) {
+  s_fd = open("/dev/null", O_WRONLY);
+  xflush_init(&s_fl, xflush_writev, &s_fd, 4096, ~0UL);
+  xsink_init(&s_xsink, &s_fl, s_xsink_mem, sizeof(s_xsink_mem));
+  printf("Log lines to /dev/null: %s", XLOG_FMT);
+  BENCH("xsnprintf, write() per line", sink_write(i_));
+  BENCH("xout_sink, xflush_writev every 4 KB", sink_batch(i_));
+  close(s_fd);
+}
+#endif
+
+#define RESP_FMT "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s"
+static char s_body[2000], s_tx[536];  // Response body, a TCP segment
+static size_t s_txlen;
+
+static size_t tx(const char *buf, size_t len, void *param) {
+  size_t n = sizeof(s_tx) - s_txlen;
+  if (n > len) n = len;
+  memcpy(s_tx + s_txlen, buf, n), s_txlen += n, (void) param;
+  return n;
+}
+
+// Format into a temporary buffer, then copy it out segment by segment
+static size_t resp_temp(void) {
+  static char tmp[4096];
+  size_t i, n = xsnprintf(tmp, sizeof(tmp), RESP_FMT, (int) strlen(s_body),
+                          s_body);
+  for (i = 0; i < n; i += s_txlen) s_txlen = 0, tx(tmp + i, n - i, NULL);
+  return n;
+}
+
+static size_t resp_resume(unsigned flags) {
+  char args[64];
+  struct xprint p;
+  size_t n = 0;
+  xprint_start(&p, args, sizeof(args), flags, RESP_FMT, (int) strlen(s_body),
+               s_body);
+  for (s_txlen = 0; !xprint_resume(&p, tx, NULL); s_txlen = 0) n++;
+  return n;
+}
+
+static void bench_xprint(void) {
+  memset(s_body, 'x', sizeof(s_body) - 1);
+  printf("HTTP response, %lu byte body, %lu byte TX buffer\n",
+         (unsigned long) strlen(s_body), (unsigned long) sizeof(s_tx));
+  BENCH("xsnprintf into 4 KB, then copy", resp_temp());
+  BENCH("xprint_resume, XLOG_REF_STR", resp_resume(XLOG_REF_STR));
+}
+
+#if defined(__cplusplus) && __cplusplus >= 201703L
+#define CPP_FMT "%s %d %5u %#x %-6s|%g"
+#define CPP_ARGS "GET", 200, 1234U, 255, "ok", 2.5
+
+static void bench_cpp(void) {
+  printf("C++ type-safe printing: %s\n", CPP_FMT);
+  BENCH("xsnprintf", xsnprintf(s_buf, sizeof(s_buf), CPP_FMT, CPP_ARGS));
+  BENCH("str::xsnprintf",
+        str::xsnprintf(s_buf, sizeof(s_buf), XFMT(CPP_FMT), CPP_ARGS));
+  BENCH("std::snprintf",
+        (size_t) std::snprintf(s_buf, sizeof(s_buf), CPP_FMT, CPP_ARGS));
+  printf("Integers: %s\n", "%d %d %d %d");
+  BENCH("xsnprintf", xsnprintf(s_buf, sizeof(s_buf), "%d %d %d %d", 1, -23,
+                               456, 7890123));
+  BENCH("str::xsnprintf", str::xsnprintf(s_buf, sizeof(s_buf),
+                                         XFMT("%d %d %d %d"), 1, -23, 456,
+                                         7890123));
+  BENCH("std::snprintf", (size_t) std::snprintf(s_buf, sizeof(s_buf),
+                                                "%d %d %d %d", 1, -23, 456,
+                                                7890123));
+}
+#endif
+
+static void bench_float(void) {
+  static const double v[] = {1.234,      -987.65432, 0.000123456, 44556677.0,
+                             2.34567e-57, 3.14159265358979, 1e21, 0.1};
+  size_t i;
+  printf("Floating point printing\n");
+  for (i = 0; i < sizeof(v) / sizeof(v[0]); i++) {
+    char name[60];
+    snprintf(name, sizeof(name), "%.17g", v[i]);
+    printf("%s\n", name);
+    BENCH("xsnprintf %g", xsnprintf(s_buf, sizeof(s_buf), "%g", v[i]));
+    BENCH("snprintf %g", (size_t) snprintf(s_buf, sizeof(s_buf), "%g", v[i]));
+    BENCH("xsnprintf %.17g", xsnprintf(s_buf, sizeof(s_buf), "%.17g", v[i]));
+    BENCH("xsnprintf %f", xsnprintf(s_buf, sizeof(s_buf), "%f", v[i]));
+    BENCH("xsnprintf %M fmt_dbl",
+          xsnprintf(s_buf, sizeof(s_buf), "%M", fmt_dbl, v[i]));
+  }
+}
+
+static void bench_int(void) {
+  static const uint32_t v32[] = {7, 1234, 3000000000U};
+  static const uint64_t v64[] = {42, 1700000000123ULL, 18446744073709551615ULL};
+  size_t i;
+  printf("Integer printing\n");
+  for (i = 0; i < sizeof(v32) / sizeof(v32[0]); i++) {
+    printf("%lu\n", (unsigned long) v32[i]);
+    BENCH("xsnprintf %d", xsnprintf(s_buf, sizeof(s_buf), "%d", (int) v32[i]));
+    BENCH("snprintf %d",
+          (size_t) snprintf(s_buf, sizeof(s_buf), "%d", (int) v32[i]));
+    BENCH("xsnprintf %u", xsnprintf(s_buf, sizeof(s_buf), "%u", v32[i]));
+    BENCH("xsnprintf %x", xsnprintf(s_buf, sizeof(s_buf), "%x", v32[i]));
+    BENCH("snprintf %x", (size_t) snprintf(s_buf, sizeof(s_buf), "%x", v32[i]));
+  }
+  for (i = 0; i < sizeof(v64) / sizeof(v64[0]); i++) {
+    printf("%llu\n", (unsigned long long) v64[i]);
+    BENCH("xsnprintf %lld",
+          xsnprintf(s_buf, sizeof(s_buf), "%lld", (int64_t) v64[i]));
+    BENCH("snprintf %lld", (size_t) snprintf(s_buf, sizeof(s_buf), "%lld",
+                                             (long long) v64[i]));
+    BENCH("xsnprintf %llx", xsnprintf(s_buf, sizeof(s_buf), "%llx", v64[i]));
+  }
+}
+
+static void bench_json_num(void) {
+  static const char *v[] = {"42", "-987.65432", "3.14159265358979",
+                            "0.30000000000000004", "2.34567e-57",
+                            "1.7976931348623157e308",
+                            "9007199254740993.0000000000000000000001"};
+  const char *arr = "[1.5, -2e10, 3.14159, 12345678, 0.001, 6.02214076e23]";
+  double d = 0.0;
+  int64_t i64 = 0;
+  size_t i;
+  printf("JSON number parsing\n");
+  for (i = 0; i < sizeof(v) / sizeof(v[0]); i++) {
+    int n = (int) strlen(v[i]);
+    printf("%s\n", v[i]);
+    BENCH("json_get_num", (size_t) json_get_num(v[i], n, "$", &d));
+    BENCH("strtod", (size_t) (strtod(v[i], NULL) > 0.0));
+  }
+  printf("%s\n", arr);
+  BENCH("json_get $[5]", (size_t) json_get(arr, (int) strlen(arr), "$[5]", 0));
+  BENCH("json_get_i64 $[3]",
+        (size_t) json_get_i64(arr, (int) strlen(arr), "$[3]", &i64));
+  BENCH("json_get_long $[3]",
+        (size_t) json_get_long(arr, (int) strlen(arr), "$[3]", 0));
+  BENCH("json_get_num $[3]",
+        (size_t) json_get_num(arr, (int) strlen(arr), "$[3]", &d));
+}
+
+static void stream_cb(int ev, const char *path, const char *tok, int len,
+                      void *param) {
+  (void) path, (void) tok;
+  *(size_t *) param += (size_t) (ev + len);
+}
+
+// Feed the document in chunks of a TCP segment size
+static size_t stream(const char *s, int len) {
+  char buf[100];
+  size_t n = 0;
+  int i, r = 0;
+  struct json_stream st;
+  json_stream_init(&st, buf, sizeof(buf), stream_cb, &n);
+  for (i = 0; i < len && r == 0; i += 1460) {
+    r = json_stream_feed(&st, s + i, len - i < 1460 ? len - i : 1460);
+  }
+  return n;
+}
+
+static void bench_json_str(void) {
+  const char *s =
+      "{\"name\": \"probe 7, north tower of the main building, level 3\"}";
+  struct xstr v;
+  int len = (int) strlen(s);
+  printf("%s\n", s);
+  BENCH("json_get_str", (size_t) json_get_str(s, len, "$.name", s_buf, 100));
+  BENCH("json_get_xstr", (size_t) json_get_xstr(s, len, "$.name", &v));
+  s = "{\"name\": \"\\u041f\\u0440\\u0438\\u0432\\u0435\\u0442 "
+      "\\ud83d\\ude00, caf\\u00e9\"}";
+  len = (int) strlen(s);
+  printf("%s\n", s);
+  BENCH("json_get_str", (size_t) json_get_str(s, len, "$.name", s_buf, 100));
+}
+
+static void bench_json_doc(void) {
+  static char doc[256 * 1024];
+  size_t i, n = 0, saved = N;
+  n += (size_t) snprintf(doc + n, sizeof(doc) - n, "{\n  \"items\": [\n");
+  for (i = 0; n + 300 < sizeof(doc); i++) {
+    n += (size_t) snprintf(
+        doc + n, sizeof(doc) - n,
+        "    {\n      \"id\": %lu,\n      \"name\": \"sensor %lu, \\\"west\\\" "
+        "wing, second floor\",\n      \"values\": [1.5, -2.25, 3e8],\n"
+        "      \"ok\": true\n    },\n",
+        (unsigned long) i, (unsigned long) i);
+  }
+  n += (size_t) snprintf(doc + n, sizeof(doc) - n, "{}\n  ],\n  \"z\": 1\n}");
+  printf("JSON document, %lu bytes\n", (unsigned long) n);
+  N = 1000;
+  BENCH("json_get $.z", (size_t) json_get(doc, (int) n, "$.z", 0));
+  BENCH("json_stream_feed, 1460 byte chunks", stream(doc, (int) n));
+  BENCH("xutf8_valid", (size_t) xutf8_valid(doc, n));
+  N = saved;
+}
+
+// Sum elements of the array `s`, `len` fetching them one by one
+static size_t iter_get(const char *s, int len) {
+  char path[20];
+  size_t n = 0;
+  int i, o, m;
+  for (i = 0;; i++) {
+    xsnprintf(path, sizeof(path), "$[%d]", i);
+    if ((o = json_get(s, len, path, &m)) < 0) break;
+    n += (size_t) json_get_long(s + o, m, "$", 0);
+  }
+  return n;
+}
+
+static size_t iter_next(const char *s, int len) {
+  struct xstr k, v;
+  size_t n = 0;
+  int ofs = 0;
+  while ((ofs = json_next(s, len, ofs, &k, &v)) > 0) {
+    n += (size_t) json_get_long(v.buf, (int) v.len, "$", 0);
+  }
+  return n;
+}
+
+static void bench_json_iter(void) {
+  static char arr[128 * 1024];
+  size_t i, n = 0, saved = N;
+  for (i = 0; i < 10000; i++) {
+    n += (size_t) snprintf(arr + n, sizeof(arr) - n, "%c%lu", i ? ',' : '[',
+                           (unsigned long) i);
+  }
+  n += (size_t) snprintf(arr + n, sizeof(arr) - n, "]");
+  printf("JSON array of 10000 numbers, %lu bytes\n", (unsigned long) n);
+  N = 3;
+  BENCH("json_get $[i], i = 0..N", iter_get(arr, (int) n));
+  N = 1000;
+  BENCH("json_next", iter_next(arr, (int) n));
+  N = saved;
+}
+
+static const char *s_paths[] = {"$.id",   "$.name", "$.loc.lat", "$.loc.lon",
+                                "$.v[0]", "$.v[5]", "$.v[9]",    "$.ok"};
+#define NPATHS (sizeof(s_paths) / sizeof(s_paths[0]))
+
+static size_t lookup_get(const char *s, int len) {
+  size_t i, n = 0;
+  for (i = 0; i < NPATHS; i++) n += (size_t) json_get(s, len, s_paths[i], 0);
+  return n;
+}
+
+static size_t lookup_index(const char *s, int len) {
+  struct json_tok t[64];
+  int nt = json_index(s, len, t, 64);
+  size_t i, n = 0;
+  for (i = 0; i < NPATHS; i++) {
+    n += (size_t) json_index_get(s, t, nt, s_paths[i], 0);
+  }
+  return n;
+}
+
+static size_t lookup_many(const char *s, int len) {
+  int ofs[NPATHS], lens[NPATHS];
+  return (size_t) json_get_many(s, len, s_paths, NPATHS, ofs, lens);
+}
+
+static void bench_json_index(void) {
+  const char *s =
+      "{\"id\": 12345, \"name\": \"probe 7, north tower\", \"loc\": "
+      "{\"lat\": 52.52, \"lon\": 13.405}, \"v\": [1, 2, 3, 4, 5, 6, 7, 8, 9, "
+      "10], \"status\": {\"code\": 200, \"text\": \"fine\"}, \"ok\": true}";
+  int len = (int) strlen(s);
+  printf("JSON, %lu lookups in %d bytes\n", (unsigned long) NPATHS, len);
+  BENCH("json_get", lookup_get(s, len));
+  BENCH("json_get_many", lookup_many(s, len));
+  BENCH("json_index + json_index_get", lookup_index(s, len));
+}
+
+static void bench_xmatch(void) {
+  static const char *patterns[] = {"#a#a#a#a#a#a#b", "#aaaaaaaaaaaaab",
+                                   "#??#??#??b", "/*/*/#.b"};
+  static char s[4096];
+  size_t i, n, saved = N;
+  char name[60];
+  memset(s, 'a', sizeof(s));
+  for (i = 0; i < sizeof(s); i += 64) s[i] = '/';
+  printf("xmatch, no match, a string of 'a' with '/' every 64 bytes\n");
+  N = 1000;
+  for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+    for (n = 256; n <= sizeof(s); n *= 4) {
+      struct xstr str = xstr_n(s, n), pat = xstr_s(patterns[i]);
+      snprintf(name, sizeof(name), "%s, %lu bytes", patterns[i],
+               (unsigned long) n);
+      BENCH(name, (size_t) xmatch(str, pat, NULL));
+    }
+  }
+  N = saved;
+}
+
+#define NROUTES 300
+static char s_patterns[NROUTES][40];
+
+static size_t route_linear(struct xstr uri) {
+  size_t i;
+  for (i = 0; i < NROUTES; i++) {
+    if (xmatch(uri, xstr_s(s_patterns[i]), NULL)) return i;
+  }
+  return 0;
+}
+
+static void bench_xroutes(void) {
+  static struct xroute routes[NROUTES];
+  static struct xroute_node nodes[NROUTES * 40];
+  struct xroutes rs;
+  struct xstr uri = xstr_s("/api/v1/res299/12345/details");
+  size_t i;
+  xroutes_init(&rs, routes, NROUTES, nodes, NROUTES * 40);
+  for (i = 0; i < NROUTES; i++) {
+    snprintf(s_patterns[i], sizeof(s_patterns[i]),
+             i % 2 ? "/api/v%lu/res%lu/*/details" : "/api/v%lu/res%lu/#",
+             (unsigned long) (i % 3), (unsigned long) i);
+    xroutes_add(&rs, xstr_s(s_patterns[i]));
+  }
+  printf("Routing %s against %d patterns, %d trie nodes\n", uri.buf, NROUTES,
+         rs.nnodes);
+  BENCH("xmatch, one pattern at a time", route_linear(uri));
+  BENCH("xroutes_match", (size_t) xroutes_match(&rs, uri, NULL));
+}
+
+#define NSUBS 20000
+static char s_filters[NSUBS][24];
+
+static size_t topic_linear(struct xstr topic) {
+  size_t i, n = 0;
+  for (i = 0; i < NSUBS; i++) n += xmatch(topic, xstr_s(s_filters[i]), NULL);
+  return n;
+}
+
+static void bench_xtopics(void) {
+  static struct xtopic_node nodes[NSUBS * 2 + 10];
+  static struct xtopic_sub subs[NSUBS];
+  struct xtopics t;
+  struct xstr topic = xstr_s("dev/12345/temp");
+  int ids[10];
+  size_t i, saved = N;
+  xtopics_init(&t, nodes, NSUBS * 2 + 10, subs, NSUBS);
+  for (i = 0; i < NSUBS; i++) {
+    snprintf(s_filters[i], sizeof(s_filters[i]),
+             i % 1000 == 0 ? "dev/*/temp" : "dev/%lu/%s", (unsigned long) i,
+             i % 2 ? "temp" : "#");
+    xtopics_add(&t, xstr_s(s_filters[i]), (int) i);
+  }
+  printf("Matching %s against %d subscriptions\n", topic.buf, NSUBS);
+  N = 100;
+  BENCH("xmatch, one filter at a time", topic_linear(topic));
+  N = saved;
+  BENCH("xtopics_match", (size_t) xtopics_match(&t, topic, ids, 10));
+}
+
+int main(void) {
+  bench_compiled();
+  bench_esc();
+  bench_b64();
+  bench_hexdump();
+  bench_dbuf();
+  bench_xlog();
+#if defined(STR_POSIX)
+  bench_sink();
+#endif
+  bench_xprint();
+#if defined(__cplusplus) && __cplusplus >= 201703L
+  bench_cpp();
+#endif
+  bench_float();
+  bench_int();
+  bench_json_num();
+  bench_json_str();
+  bench_json_doc();
+  bench_json_index();
+  bench_json_iter();
+  bench_xmatch();
+  bench_xroutes();
+  bench_xtopics();
+  return (int) (s_sink & 0);
+}
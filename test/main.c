@@ -5,10 +5,20 @@
 #include <float.h>   // DBL_EPSILON and HUGE_VAL
 #include <math.h>    // NAN
 #include <stdio.h>   // printf/snprintf etc
+#include <stdlib.h>  // strtod, realloc
 #include <string.h>  // strcmp
 
 #include "str.h"
 
+#if defined(STR_POSIX)
+#include <unistd.h>  // pipe, read, close
+#endif
+
+#if defined(__cplusplus) && __cplusplus >= 201703L
+#include <string>
+#include "str.hpp"
+#endif
+
 static int sf(const char *expected, const char *fmt, ...) {
   char buf[100];
   va_list ap;
@@ -43,6 +53,46 @@ static int sn(const char *fmt, ...) {
   return result;
 }
 
+// This function compares precompiled format with xvprintf()
+static int sc(const char *fmt, ...) {
+  char buf[100], buf2[sizeof(buf)];
+  struct xfmt_op ops[20];
+  struct xbuf mb = {buf, sizeof(buf), 0};
+  size_t n, n2, nops = xfmt_compile(fmt, ops, sizeof(ops) / sizeof(ops[0]));
+  va_list ap;
+  int result;
+  va_start(ap, fmt);
+  n = xvprintfc(xout_buf, &mb, ops, nops, &ap);
+  va_end(ap);
+  buf[n < sizeof(buf) ? n : sizeof(buf) - 1] = '\0';
+  va_start(ap, fmt);
+  n2 = xvsnprintf(buf2, sizeof(buf2), fmt, &ap);
+  va_end(ap);
+  result = n == n2 && strcmp(buf, buf2) == 0;
+  if (!result) printf("[%s] -> [%s] != [%s]\n", fmt, buf, buf2);
+  return result;
+}
+
+static void test_compiled(void) {
+  struct xfmt_op ops[3];
+  uint32_t ip4 = 0x0100007f;
+  assert(xfmt_compile("", ops, 3) == 0);
+  assert(xfmt_compile("a%db%s", ops, 3) == 4);
+  assert(ops[0].len == 1 && ops[1].conv == 'd' && ops[2].str[0] == 'b');
+  assert(xfmt_compile("%-08.3lld", ops, 3) == 1);
+  assert(ops[0].minus && ops[0].pad == '0' && ops[0].width == 8);
+  assert(ops[0].prec == 3 && ops[0].lng == 2 && ops[0].conv == 'd');
+  assert(sc("ab"));
+  assert(sc("%d %5s|%-5s|%05d", 7, "pad", "x", -42));
+  assert(sc("%#04x %#-6x %02x %lx %p", 11, 15, 3, 0x6204d754UL, (void *) 7));
+  assert(sc("%.*s %.1s %c %% %v", 3, "foobar", "ab", 'x', 1));
+  assert(sc("%s: %g %.*g %f", "dbl", 1.234, 10, 123.456222, 0.5));
+  assert(sc("JSON: {%m: %g}", XESC("value"), 1.234));
+  assert(sc("_%M_%d %m", fmt_ip4, &ip4, 123, fmt_b64, 3, "xyz"));
+  assert(sc("%lld %llu %hhd %hd", (int64_t) -1, (uint64_t) -1, 1, 2));
+  assert(sc("trailing %"));
+}
+
 static void test_std(void) {
   assert(sn("%d", 0));
   assert(sn("%d", 1));
@@ -90,6 +140,26 @@ static void test_std(void) {
   assert(sn("%2s %s", "a", "b"));
 
   assert(sf("foo %v", "foo %v", 123));  // Uknown specifier left intact
+
+  {
+    // Compare random integers of all magnitudes with libc
+    uint32_t i, x = 42;
+    uint64_t v;
+    for (i = 0; i < 20000; i++) {
+      x ^= x << 13, x ^= x >> 17, x ^= x << 5, v = (uint64_t) x << 32;
+      x ^= x << 13, x ^= x >> 17, x ^= x << 5, v |= x;
+      v >>= i % 64;
+      assert(sn("%d|%u|%x", (int) v, (unsigned) v, (unsigned) v));
+      assert(sn("%ld|%lu|%lx", (long) v, (unsigned long) v, (unsigned long) v));
+#if !defined(_MSC_VER)
+      assert(sn("%lld|%llu|%llx", (int64_t) v, v, v));
+      assert(sn("%lld", (int64_t) -v));
+#endif
+    }
+#if !defined(_MSC_VER)
+    assert(sn("%lld", (int64_t) XU64(0x80000000, 0)));
+#endif
+  }
 }
 
 static void test_float(void) {
@@ -141,6 +211,26 @@ static void test_float(void) {
   TEST_FLOAT("%g", -600.1234, "-600.123");
   TEST_FLOAT("%g", 599.1234, "599.123");
   TEST_FLOAT("%g", -599.1234, "-599.123");
+  TEST_FLOAT("%g", 0.00001, "1e-05");
+  TEST_FLOAT("%g", -0.0, "-0");
+  TEST_FLOAT("%.3g", 0.001234, "0.00123");
+  TEST_FLOAT("%.1g", 0.15, "0.1");
+  TEST_FLOAT("%.1g", 2.5, "2");
+  TEST_FLOAT("%.17g", 0.1, "0.10000000000000001");
+  TEST_FLOAT("%f", 0.0, "0.000000");
+  TEST_FLOAT("%f", 1.5, "1.500000");
+  TEST_FLOAT("%.2f", 0.125, "0.12");
+  TEST_FLOAT("%.2f", 0.375, "0.38");
+  TEST_FLOAT("%.0f", 0.5, "0");
+  TEST_FLOAT("%.1f", 0.04, "0.0");
+  TEST_FLOAT("%.3f", -123.4567, "-123.457");
+  TEST_FLOAT("%.1f", 1e21, "1000000000000000000000.0");
+  TEST_FLOAT("%M", DBLWIDTH(fmt_dbl, 0.1), "0.1");
+  TEST_FLOAT("%M", DBLWIDTH(fmt_dbl, 1.0 / 3), "0.3333333333333333");
+  TEST_FLOAT("%M", DBLWIDTH(fmt_dbl, 123.0), "123");
+  TEST_FLOAT("%M", DBLWIDTH(fmt_dbl, 1e-7), "1e-07");
+  TEST_FLOAT("%M", DBLWIDTH(fmt_dbl, 5e-324), "5e-324");
+  TEST_FLOAT("%M", DBLWIDTH(fmt_dbl, DBL_MAX), "1.7976931348623157e+308");
 
 #ifndef _WIN32
   TEST_FLOAT("%g", (double) INFINITY, "inf");
@@ -151,12 +241,66 @@ static void test_float(void) {
   TEST_FLOAT("%g", -HUGE_VAL, "-inf");
 #endif
 
+  {
+    // Output longer than 40 characters, exact past the 17th digit
+    char buf[400], buf2[sizeof(buf)];
+    const char *s = "10000000000000000303786028427003666890752.000000";
+    assert(xsnprintf(buf, sizeof(buf), "%f", 1e40) == strlen(s));
+    assert(strcmp(buf, s) == 0);
+    s = "0.1000000000000000055511151231257827021182";
+    assert(xsnprintf(buf, sizeof(buf), "%.40f", 0.1) == strlen(s));
+    assert(strcmp(buf, s) == 0);
+    s = "0.10000000000000000555111512312578270211815834";
+    assert(xsnprintf(buf, sizeof(buf), "%.45g", 0.1) == strlen(s));
+    assert(strcmp(buf, s) == 0);
+    assert(xsnprintf(buf, sizeof(buf), "%f", 1e300) == 308);
+    assert(strncmp(buf, "1000000000000000052504760255204420248704", 40) == 0);
+    assert(strcmp(buf + 301, ".000000") == 0);
+    assert(xsnprintf(buf, 10, "%f", -3e45) == 54);
+    assert(strcmp(buf, "-30000000") == 0);
+#if !defined(_MSC_VER) || _MSC_VER >= 1900
+    snprintf(buf2, sizeof(buf2), "%f", 1e300);
+    xsnprintf(buf, sizeof(buf), "%f", 1e300);
+    assert(strcmp(buf, buf2) == 0);
+#endif
+  }
+
   {
     char buf[20];
     double d;
     json_get_num("1.23", 4, "$", &d);      // Parse floating point number
     xsnprintf(buf, sizeof(buf), "%g", d);  // 1.23 (print parsed number)
   }
+
+  {
+    // Compare random doubles with libc, and check that the shortest
+    // representation reads back to the same double
+    union {
+      uint64_t u;
+      double d;
+    } u = {0};
+    uint32_t i, x = 12345;
+    char buf[40];
+    double d;
+    for (i = 0; i < 20000; i++) {
+      x ^= x << 13, x ^= x >> 17, x ^= x << 5, u.u = (uint64_t) x << 32;
+      x ^= x << 13, x ^= x >> 17, x ^= x << 5, u.u |= x;
+      if (((u.u >> 52) & 0x7ff) == 0x7ff) continue;  // inf or nan
+      xsnprintf(buf, sizeof(buf), "%M", fmt_dbl, u.d);
+      assert(strtod(buf, NULL) == u.d);
+      assert(json_get_num(buf, (int) strlen(buf), "$", &d) == 1 && d == u.d);
+      xsnprintf(buf, sizeof(buf), "%.3g", u.d);
+      assert(json_get_num(buf, (int) strlen(buf), "$", &d) == 1);
+      assert(d == strtod(buf, NULL));
+#if !defined(_MSC_VER) || _MSC_VER >= 1900
+      assert(sn("%g", u.d));
+      assert(sn("%.3g", u.d));
+      assert(sn("%.17g", u.d));
+      if (u.d < 1e15 && u.d > -1e15) assert(sn("%f", u.d));
+      if (u.d < 1e15 && u.d > -1e15) assert(sn("%.2f", u.d));
+#endif
+    }
+  }
 }
 
 static void out(char ch, void *arg) {
@@ -177,6 +321,10 @@ static void test_m(void) {
   assert(sf("_eHl6_123", "_%M_%d", fmt_b64, 3, "xyz", 123));
   assert(sf(quo, "_%m_%d", fmt_ip4, &ip4, 123));
   assert(sf(quo, "_%m_%d", XESC("127.0.0.1"), 123));
+  assert(sf("\\\"\\\\\\t\\u0001\\u001fx\x7f", "%M", XESC("\"\\\t\1\x1fx\x7f")));
+  assert(sf("0123456789abcdef", "%M", fmt_esc, 17, "0123456789abcdef\0"));
+  assert(sf("0123456789abcdef\\b", "%M", fmt_esc, 20,
+            "0123456789abcdef\b\0ab"));
 
   xprintf(out, NULL, "%s: %g\n", "dbl", 1.234);  // dbl: 1.234
   xprintf(out, NULL, "%.*s\n", 3, "foobar");     // foo
@@ -186,8 +334,44 @@ static void test_m(void) {
   xprintf(out, NULL, "JSON: {%m: %g}\n", XESC("value"), 1.234);
 }
 
-static void test_json(void) {
+struct spans {
   char buf[100];
+  size_t len, calls;
+};
+
+static void outs(const char *buf, size_t len, void *arg) {
+  struct spans *s = (struct spans *) arg;
+  memcpy(s->buf + s->len, buf, len);
+  s->len += len, s->calls++;
+  s->buf[s->len] = '\0';
+}
+
+static void test_span(void) {
+  struct spans s;
+  memset(&s, 0, sizeof(s));
+  assert(xprintfs(outs, &s, "hello, world") == 12);
+  assert(s.calls == 1 && strcmp(s.buf, "hello, world") == 0);
+  memset(&s, 0, sizeof(s));
+  assert(xprintfs(outs, &s, "[%20s]", "foobar") == 22);
+  assert(s.calls == 4 && strcmp(s.buf, "[              foobar]") == 0);
+  memset(&s, 0, sizeof(s));
+  assert(xprintfs(outs, &s, "%M", XESC("a\nbc")) == 5);
+  assert(s.calls == 3 && strcmp(s.buf, "a\\nbc") == 0);
+  memset(&s, 0, sizeof(s));
+  assert(xprintfs(outs, &s, "%-4d|%04x|%m", 7, 10, fmt_ip4, "\1\2\3\4") ==
+         19);
+  assert(strcmp(s.buf, "7   |000a|\"1.2.3.4\"") == 0);
+}
+
+// Parse a JSON number, and check that it is exactly `expected`
+static int jnum(const char *str, double expected) {
+  double d = 1.0;
+  return json_get_num(str, (int) strlen(str), "$", &d) == 1 &&
+         memcmp(&d, &expected, sizeof(d)) == 0;
+}
+
+static void test_json(void) {
+  char buf[160];
   const char *s = "{\"a\": -42, \"b\": [\"hi\\t\\u0020\", true, { }, -1.7e-2]}";
   const char *s2 = "\"foobar\"";
   int ofs, n, b = 0, len = (int) strlen(s);
@@ -202,10 +386,266 @@ static void test_json(void) {
   assert((ofs = json_get(s, len, "$.b[2]", &n)) > 0);
   assert(n == 3 && s[ofs] == '{' && s[ofs + 2] == '}');
   assert(json_get_num(s, len, "$.b[3]", &d) == 1 && d == -0.017);
+  assert(jnum("0.1", 0.1) && jnum("1e23", 1e23) && jnum("-0.0", -0.0));
+  assert(jnum("9007199254740993", 9007199254740992.0));
+  assert(jnum("9007199254740993.0000000000000000000001", 9007199254740994.0));
+  assert(jnum("2.2250738585072011e-308", 2.2250738585072011e-308));
+  assert(jnum("2.4703282292062327e-324", 0.0));
+  assert(jnum("2.4703282292062328e-324", 4.9406564584124654e-324));
+  assert(jnum("1.7976931348623158e308", DBL_MAX));
+  assert(jnum("1e-400", 0.0) && jnum("0e999999", 0.0));
+  assert(json_get_num("1e400", 5, "$", &d) == 1 && d > DBL_MAX);
+  assert(json_get_num("1e40000", 7, "$", &d) == 1 && d > DBL_MAX);
+  assert(json_get_num("-1e99999999999", 14, "$", &d) == 1 && d < -DBL_MAX);
+  assert(jnum("1e-99999999999", 0.0) && jnum("1e-000000000001", 0.1));
+  assert(json_get_long("[1.5e3,7]", 9, "$[1]", 0) == 7);
+  assert(json_get_long("[1.5e3,7]", 9, "$[0]", 0) == 1500);
+
+  // Escapes and whitespace runs at all offsets within 16-byte blocks
+  for (ofs = 0; ofs < 40; ofs++) {
+    int k = 0, m;
+    k += sprintf(buf + k, "{\"a\":%*s\"", ofs, "");
+    for (m = 0; m < ofs; m++) {
+      buf[k++] = m % 7 == 3 && m + 1 < ofs ? '\\' : 'x';  // Lone backslash
+    }
+    k += sprintf(buf + k, "\\\"\\\\\",%*s\"b\" :\n%*s7}", ofs, "",
+                 40 - ofs, "");
+    assert(json_get_long(buf, k, "$.b", 0) == 7);
+    assert(json_get(buf, k, "$.a", &n) == ofs + 5 && n == ofs + 6);
+    buf[k - 2] = '\0';
+    assert(json_get_long(buf, k, "$.b", 0) == 0);
+  }
   assert((ofs = json_get(s2, (int) strlen(s2), "$", &n)) == 0);
   assert(n == 8);
 }
 
+static void test_json_int(void) {
+  const char *s = "[9007199254740993, -9223372036854775808, "
+                  "18446744073709551615, 18446744073709551616, 1.5, -0, \"1\"]";
+  int len = (int) strlen(s);
+  int64_t i = 0;
+  uint64_t u = 0;
+  assert(json_get_i64(s, len, "$[0]", &i) == 1);
+  assert(i == (int64_t) XU64(0x200000, 1));
+  assert(json_get_u64(s, len, "$[0]", &u) == 1 && u == XU64(0x200000, 1));
+  assert(json_get_i64(s, len, "$[1]", &i) == 1);
+  assert(i == -(int64_t) XU64(0x7fffffff, 0xffffffff) - 1);
+  assert(json_get_u64(s, len, "$[1]", &u) == 0);
+  assert(json_get_i64(s, len, "$[2]", &i) == 0);
+  assert(json_get_u64(s, len, "$[2]", &u) == 1 && u == ~(uint64_t) 0);
+  assert(json_get_u64(s, len, "$[3]", &u) == 0);  // Overflow
+  assert(json_get_i64(s, len, "$[4]", &i) == 0);  // Not an integer
+  assert(json_get_i64(s, len, "$[5]", &i) == 1 && i == 0);
+  assert(json_get_i64(s, len, "$[6]", &i) == 0);  // String
+  assert(json_get_i64(s, len, "$[7]", &i) == 0);  // Not found
+  assert(json_get_long(s, len, "$[4]", 0) == 1);
+  assert(json_get_long(s, len, "$[6]", 42) == 42);
+}
+
+static void test_json_many(void) {
+  const char *s =
+      "{\"a\": -42, \"b\": [\"hi\", true, { }, 1], \"c\": {\"d\": 7}}";
+  const char *paths[] = {"$.c.d", "$.b[1]", "$.x", "a", "$.b[2]", "$",
+                         "$.a",   "$.b[0]", "$.b[3]", "$.b", "$.c",
+                         "$.b[4]", "$.c.e", "$.a", "$.b[2]", "$.c.d",
+                         "$.b[1]", "$.b[0]"};
+  int i, n, ofs[18], lens[18], len = (int) strlen(s);
+  assert(json_get_many(s, len, paths, 18, ofs, lens) == 14);
+  for (i = 0; i < 18; i++) {
+    int o = json_get(s, len, paths[i], &n);
+    assert(o == ofs[i] && n == lens[i]);
+  }
+  assert(json_get_many(s, len - 1, paths, 3, ofs, lens) == 2);
+  assert(ofs[0] == 49 && ofs[1] == 23 && ofs[2] == -2);
+  assert(json_get_many("[1,}", 4, paths + 5, 1, ofs, lens) == 0);
+  assert(ofs[0] == -1);
+}
+
+static void test_json_next(void) {
+  const char *s = "{\"a\": [1, \"x,]\", {\"b\": 2} ,[], true ], \"c\" : null}";
+  char path[10];
+  struct xstr k, v;
+  int i, n, m, o, ofs, len = (int) strlen(s), a = json_get(s, len, "$.a", &n);
+
+  // Array elements are the same as found by json_get(), keys are empty
+  for (i = 0, ofs = 0; (ofs = json_next(s + a, n, ofs, &k, &v)) > 0; i++) {
+    xsnprintf(path, sizeof(path), "$.a[%d]", i);
+    o = json_get(s, len, path, &m);
+    assert(k.buf == NULL && k.len == 0);
+    assert(v.buf == s + o && (int) v.len == m);
+  }
+  assert(i == 5);
+
+  ofs = json_next(s, len, 0, &k, &v);
+  assert(ofs == 37 && k.len == 3 && memcmp(k.buf, "\"a\"", 3) == 0);
+  assert(v.buf == s + a && (int) v.len == n);
+  ofs = json_next(s, len, ofs, &k, &v);
+  assert(ofs == 49 && k.len == 3 && memcmp(k.buf, "\"c\"", 3) == 0);
+  assert(v.len == 4 && memcmp(v.buf, "null", 4) == 0);
+  assert(json_next(s, len, ofs, &k, &v) == 0);
+
+  assert(json_next("[ ]", 3, 0, &k, &v) == 0);
+  assert(json_next("{}", 2, 0, &k, &v) == 0);
+  assert(json_next("1", 1, 0, &k, &v) == 0);
+  assert(json_next("[1 2]", 5, 2, &k, &v) == 0);
+  assert(json_next("{\"a\" 1}", 7, 0, &k, &v) == 0);
+  assert(json_next("[1,", 3, 2, &k, &v) == 0);
+}
+
+static void test_json_xstr(void) {
+  char s[] = "{\"a\": \"plain text\", \"b\": [\"x\\ty\\\\z\\u0041\\\"\", 1]}";
+  int len = (int) strlen(s);
+  struct xstr v;
+
+  // No escapes: a view into the source
+  assert(json_get_xstr(s, len, "$.a", &v) == 0);
+  assert(v.buf == s + 7 && v.len == 10 && memcmp(v.buf, "plain text", 10) == 0);
+  assert(json_unescape_xstr(&v) == 10 && v.buf == s + 7 && v.len == 10);
+  assert(s[17] == '"');
+
+  // Escapes: unescape in place
+  assert(json_get_xstr(s, len, "$.b[0]", &v) == 1);
+  assert(v.buf == s + 27 && v.len == 15);
+  assert(json_unescape_xstr(&v) == 7 && v.buf == s + 27 && v.len == 7);
+  assert(memcmp(v.buf, "x\ty\\zA\"", 7) == 0);
+
+  assert(json_get_xstr(s, len, "$.b[1]", &v) < 0);
+  assert(json_get_xstr(s, len, "$.c", &v) < 0);
+  v.buf = s + 7, v.len = 7, s[8] = '\\';  // "p\ain t"
+  assert(json_unescape_xstr(&v) < 0);
+}
+
+static void test_utf8(void) {
+  char buf[20], src[20];
+  uint32_t i, cp, x = 42;
+  const char *s = "\"\\u00e9\\u20AC\\ud83d\\ude00x\"";
+  assert(json_get_str(s, (int) strlen(s), "$", buf, sizeof(buf)) == 10);
+  assert(strcmp(buf, "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80x") == 0);
+  assert(json_get_str("\"\\u20ac\"", 8, "$", buf, 4) == 3);
+  assert(json_get_str("\"\\u20ac\"", 8, "$", buf, 3) < 0);
+  assert(json_get_str("\"\\ud83d\"", 8, "$", buf, sizeof(buf)) < 0);
+  assert(json_get_str("\"\\ude00\"", 8, "$", buf, sizeof(buf)) < 0);
+  assert(json_get_str("\"\\ud83dx\"", 9, "$", buf, sizeof(buf)) < 0);
+  assert(json_get_str("\"\\ud83d\\u0041\"", 14, "$", buf, sizeof(buf)) < 0);
+  assert(json_get_str("\"\\u12g4\"", 8, "$", buf, sizeof(buf)) < 0);
+  assert(json_get_str("\"\\u12\"", 6, "$", buf, sizeof(buf)) < 0);
+
+  // Decode random code points back from UTF-8
+  for (i = 0; i < 10000; i++) {
+    size_t n;
+    x ^= x << 13, x ^= x >> 17, x ^= x << 5, cp = (x >> 8) % 0x110000;
+    if (cp >= 0xd800 && cp < 0xe000) continue;
+    if (cp < 0x10000) {
+      xsnprintf(src, sizeof(src), "\"\\u%04x\"", cp);
+    } else {
+      xsnprintf(src, sizeof(src), "\"\\u%04x\\u%04X\"",
+                0xd800 + ((cp - 0x10000) >> 10), 0xdc00 + (cp & 0x3ff));
+    }
+    n = (size_t) json_get_str(src, (int) strlen(src), "$", buf, sizeof(buf));
+    assert(n == (cp < 0x80 ? 1U : cp < 0x800 ? 2U : cp < 0x10000 ? 3U : 4U));
+    assert(xutf8_valid(buf, n));
+    if (n > 1) {
+      uint32_t k, v = (uint8_t) buf[0] & (0x7f >> n);
+      for (k = 1; k < n; k++) v = v << 6 | ((uint8_t) buf[k] & 0x3f);
+      assert(v == cp);
+    } else {
+      assert((uint8_t) buf[0] == cp);
+    }
+  }
+
+  assert(xutf8_valid("", 0));
+  assert(xutf8_valid("plain ASCII text, longer than 16 bytes", 38));
+  assert(xutf8_valid("caf\xc3\xa9 \xe2\x82\xac \xf4\x8f\xbf\xbf", 14));
+  assert(!xutf8_valid("\xc0\xaf", 2));              // Overlong
+  assert(!xutf8_valid("\xe0\x9f\xbf", 3));          // Overlong
+  assert(!xutf8_valid("\xed\xa0\x80", 3));          // Surrogate
+  assert(!xutf8_valid("\xf4\x90\x80\x80", 4));      // Above U+10FFFF
+  assert(!xutf8_valid("0123456789abcdef\xe2\x82", 18));  // Truncated
+  assert(!xutf8_valid("\xe2\x82x", 3));
+  assert(!xutf8_valid("\x80", 1));
+}
+
+static void test_json_index(void) {
+  const char *s = "{\"a\": -42, \"b\": [\"hi\\t\", true, { }, -1.7e-2], "
+                  "\"c\": {\"d\": [1, [2, 3]], \"a\": null}}";
+  const char *paths[] = {"$",      "$.a",      "$.b",      "$.b[0]",
+                         "$.b[2]", "$.b[3]",   "$.b[4]",   "$.c.d[1][1]",
+                         "$.c.a",  "$.c.d[2]", "$.x",      "$.b.a"};
+  struct json_tok t[30];
+  int i, n, n2, len = (int) strlen(s), nt = json_index(s, len, t, 30);
+  assert(nt == 19);
+  assert(t[0].ofs == 0 && t[0].len == len && t[0].parent == -1);
+  assert(t[0].next == nt);
+  assert(t[1].ofs == 1 && t[1].len == 3 && t[1].next == 3);  // Key "a"
+  assert(t[2].parent == 0 && t[4].parent == 0 && t[5].parent == 4);
+  for (i = 0; i < (int) (sizeof(paths) / sizeof(paths[0])); i++) {
+    int a = json_get(s, len, paths[i], &n);
+    int b = json_index_get(s, t, nt, paths[i], &n2);
+    assert(a < 0 ? b < 0 : a == b && n == n2);
+  }
+  assert(json_index(s, len, t, 3) == nt);  // Too small, returns needed size
+  assert(json_index(s, len - 1, t, 30) == -2);
+  assert(json_index("[1,}", 4, t, 30) == -1);
+  assert(json_index("7", 1, t, 30) == 1 && t[0].len == 1);
+  assert(json_index_get("7", t, 1, "$", &n) == 0 && n == 1);
+}
+
+static void json_stream_cb(int ev, const char *path, const char *tok, int len,
+                           void *param) {
+  xprintf(xout_buf, param, "%d %s %.*s,", ev, path, len, tok);
+}
+
+static void test_json_stream(void) {
+  const char *s = "{\"a\": -42, \"bb\": [\"hi\\\"\", true, { }, [], 1.5e3], "
+                  "\"c\": {\"d\": null}} {\"x\":1}";
+  const char *expected =
+      "1 $ {,0 $.a -42,1 $.bb [,0 $.bb[0] \"hi\\\"\",0 $.bb[1] true,"
+      "1 $.bb[2] {,2 $.bb[2] },1 $.bb[3] [,2 $.bb[3] ],0 $.bb[4] 1.5e3,"
+      "2 $.bb ],1 $.c {,0 $.c.d null,2 $.c },2 $ },";
+  char log[300], tok[8];
+  struct xbuf mb = {log, sizeof(log), 0};
+  struct json_stream st;
+  int i, n, r, len = (int) strlen(s);
+
+  // Feed the document in chunks of every size, including 1 byte
+  for (n = 1; n <= len; n++) {
+    json_stream_init(&st, tok, sizeof(tok), json_stream_cb, &mb);
+    for (mb.len = 0, r = 0, i = 0; r == 0 && i < len; i += n) {
+      r = json_stream_feed(&st, s + i, i + n < len ? n : len - i);
+    }
+    assert(r > 0 && i - n + r == 66 && mb.len < sizeof(log));
+    log[mb.len] = '\0';
+    assert(strcmp(log, expected) == 0);
+  }
+
+  // The next document starts right after the previous one
+  mb.len = 0;
+  assert(json_stream_feed(&st, s + 66, len - 66) == len - 66);
+  assert(mb.len == 20 && memcmp(log, "1 $ {,0 $.x 1,2 $ },", 20) == 0);
+
+  // A top level number ends with a whitespace
+  assert(json_stream_feed(&st, "42", 2) == 0);
+  assert(json_stream_feed(&st, "\n", 1) == 1);
+  assert(json_stream_feed(&st, "42]", 3) == -1);
+
+  json_stream_init(&st, tok, sizeof(tok), json_stream_cb, &mb);
+  assert(json_stream_feed(&st, "[1,]", 4) == -1);
+  json_stream_init(&st, tok, sizeof(tok), json_stream_cb, &mb);
+  assert(json_stream_feed(&st, "{\"a\":}", 6) == -1);
+  json_stream_init(&st, tok, sizeof(tok), json_stream_cb, &mb);
+  assert(json_stream_feed(&st, "[tru", 4) == 0);
+  assert(json_stream_feed(&st, "x]", 2) == -1);
+  json_stream_init(&st, tok, sizeof(tok), json_stream_cb, &mb);
+  assert(json_stream_feed(&st, "[[[[[[[[[[[[[[[[[[[[[", 21) == -3);
+
+  // A token longer than the buffer can not be split
+  json_stream_init(&st, tok, sizeof(tok), json_stream_cb, &mb);
+  assert(json_stream_feed(&st, "[\"0123456789\"", 13) == 0);
+  json_stream_init(&st, tok, sizeof(tok), json_stream_cb, &mb);
+  assert(json_stream_feed(&st, "[\"0123", 6) == 0);
+  assert(json_stream_feed(&st, "456789\"", 7) == -3);
+}
+
 static void test_base64(void) {
   char a[100], b[100];
   const char *expected = "\"aGk=\"";
@@ -215,8 +655,485 @@ static void test_base64(void) {
   assert(strcmp(a, expected) == 0);
   assert(json_get_b64(a, (int) strlen(a), "$", b, sizeof(b)) == 2);
   assert(strcmp(b, "hi") == 0);
+
+  // Long inputs go through the vectorised kernels, if enabled
+  {
+    char raw[100], enc[200], dec[104];
+    size_t i, n;
+    for (i = 0; i < sizeof(raw); i++) raw[i] = (char) (i * 37 + 11);
+    for (i = 0; i <= sizeof(raw); i++) {
+      n = xsnprintf(enc, sizeof(enc), "%M", fmt_b64, (int) i, raw);
+      assert(n == (i + 2) / 3 * 4);
+      assert(xb64_decode(enc, n, dec, sizeof(dec)) == i);
+      assert(memcmp(dec, raw, i) == 0);
+    }
+    xsnprintf(enc, sizeof(enc), "%M", fmt_b64, 60, raw);
+    assert(xb64_decode(enc, 80, dec, 45) == 0);  // Destination too small
+    enc[30] = '*';
+    assert(xb64_decode(enc, 80, dec, sizeof(dec)) == 0);  // Invalid char
+  }
+  assert(xb64_decode("AAAAAAAAAAAAAAAAAAAAAAAAAAAA", 28, b, sizeof(b)) == 21);
+  assert(xb64_decode("/+/+/+/+/+/+/+/+/+/+", 20, b, sizeof(b)) == 15);
+  assert((unsigned char) b[0] == 0xff && (unsigned char) b[1] == 0xef);
+}
+
+static void test_base64_stream(void) {
+  struct xb64 ctx;
+  char raw[200], enc[300], dec[210], buf[300];
+  struct xbuf xb = {buf, sizeof(buf), 0};
+  size_t i, k, n, chunk;
+  int m;
+  for (i = 0; i < sizeof(raw); i++) raw[i] = (char) (i * 13 + 5);
+
+  // Encoding in chunks of any size produces the same output as fmt_b64
+  n = xsnprintf(enc, sizeof(enc), "%M", fmt_b64, (int) sizeof(raw), raw);
+  for (chunk = 1; chunk < 40; chunk++) {
+    xb64_init(&ctx, 0);
+    xb.len = 0;
+    for (i = 0; i < sizeof(raw); i += k) {
+      k = sizeof(raw) - i < chunk ? sizeof(raw) - i : chunk;
+      xb64_encode_feed(&ctx, xout_buf, &xb, raw + i, k);
+    }
+    assert(xb64_encode_end(&ctx, xout_buf, &xb) == 4);  // 200 % 3 == 2
+    assert(xb.len == n && memcmp(buf, enc, n) == 0);
+  }
+
+  // So does decoding
+  for (chunk = 1; chunk < 40; chunk++) {
+    xb64_init(&ctx, 0);
+    for (i = 0, k = 0; i < n; i += chunk) {
+      size_t len = n - i < chunk ? n - i : chunk;
+      assert((m = xb64_decode_feed(&ctx, enc + i, len, dec + k, 210 - k)) >= 0);
+      k += (size_t) m;
+    }
+    assert(xb64_decode_end(&ctx) == 0);
+    assert(k == sizeof(raw) && memcmp(dec, raw, k) == 0);
+  }
+
+  // MIME style: lines of 76 characters, whitespace is skipped
+  for (i = k = 0; i < n; i++) {
+    if (i > 0 && i % 76 == 0) buf[k++] = '\r', buf[k++] = '\n';
+    buf[k++] = enc[i];
+  }
+  xb64_init(&ctx, 0);
+  assert(xb64_decode_feed(&ctx, buf, k, dec, sizeof(dec)) == -1);
+  xb64_init(&ctx, XB64_SKIP_SPACE);
+  assert(xb64_decode_feed(&ctx, buf, k, dec, sizeof(dec)) == 200);
+  assert(xb64_decode_end(&ctx) == 0 && memcmp(dec, raw, 200) == 0);
+
+  // Padding, truncated and invalid input
+  xb64_init(&ctx, 0);
+  assert(xb64_decode_feed(&ctx, "aG", 2, dec, sizeof(dec)) == 1);
+  assert(xb64_decode_feed(&ctx, "k=", 2, dec + 1, sizeof(dec)) == 1);
+  assert(xb64_decode_end(&ctx) == 0 && memcmp(dec, "hi", 2) == 0);
+  assert(xb64_decode_feed(&ctx, "aGk", 3, dec, sizeof(dec)) == 2);
+  assert(xb64_decode_end(&ctx) == 0);  // Padding is optional
+  assert(xb64_decode_feed(&ctx, "aGlaa", 5, dec, sizeof(dec)) == 3);
+  assert(xb64_decode_end(&ctx) == -1);  // Dangling character
+  assert(xb64_decode_feed(&ctx, "aGk=aGk=", 8, dec, sizeof(dec)) == -1);
+  xb64_init(&ctx, 0);
+  assert(xb64_decode_feed(&ctx, "aG==", 4, dec, sizeof(dec)) == 1);
+  assert(xb64_decode_feed(&ctx, "=", 1, dec, sizeof(dec)) == -1);
+  xb64_init(&ctx, 0);
+  assert(xb64_decode_feed(&ctx, "a=", 2, dec, sizeof(dec)) == -1);
+  xb64_init(&ctx, 0);
+  assert(xb64_decode_feed(&ctx, "aG=", 3, dec, sizeof(dec)) == 1);
+  assert(xb64_decode_end(&ctx) == -1);  // Incomplete padding
+  assert(xb64_decode_feed(&ctx, "aGk*", 4, dec, sizeof(dec)) == -1);
+  xb64_init(&ctx, 0);
+  assert(xb64_decode_feed(&ctx, "aGlm", 4, dec, 2) == -1);  // dst too small
 }
 
+static void test_hexdump(void) {
+  static char out[4096];
+  struct xbuf xb = {out, sizeof(out), 0};
+  uint8_t data[40];
+  size_t i;
+  for (i = 0; i < sizeof(data); i++) data[i] = (uint8_t) (i * 7 + 30);
+  xhexdump(xout_buf, &xb, data, sizeof(data));
+  xout_buf('\0', &xb);
+  assert(strcmp(out,
+                "0000   1e 25 2c 33 3a 41 48 4f 56 5d 64 6b 72 79 80 87   "
+                ".%,3:AHOV]dkry..\n"
+                "0010   8e 95 9c a3 aa b1 b8 bf c6 cd d4 db e2 e9 f0 f7   "
+                "................\n"
+                "0020   fe 05 0c 13 1a 21 28 2f                           "
+                ".....!(/        \n") == 0);
+  xb.len = 0;
+  xhexdump(xout_buf, &xb, data, 0);
+  xout_buf('\0', &xb);
+  assert(strcmp(out, "\n") == 0);
+
+  // Addresses that do not fit in 4 hex digits
+  xb.len = 0;
+  xhexdump_at(xout_buf, &xb, "hello", 5, 0x1fff8);
+  xout_buf('\0', &xb);
+  assert(strcmp(out,
+                "0001fff8   68 65 6c 6c 6f                                   "
+                " hello           \n") == 0);
+}
+
+static size_t s_allocs;  // Number of calls to heap()
+
+static void *heap(void *ptr, size_t oldsize, size_t size, void *param) {
+  (void) oldsize, (void) param, s_allocs++;
+  if (size > 0) return realloc(ptr, size);
+  free(ptr);
+  return NULL;
+}
+
+static void test_dbuf(void) {
+  static char mem[256];
+  struct xarena arena = {mem, sizeof(mem), 0};
+  struct xdbuf db;
+  char expected[600], *p, *q;
+  size_t i, n;
+  for (i = 0, n = 0; i < 100; i++) {
+    n += xsnprintf(expected + n, sizeof(expected) - n, "%lu,",
+                   (unsigned long) i);
+  }
+
+  // Heap: the buffer grows geometrically
+  xdbuf_init(&db, heap, NULL);
+  s_allocs = 0;
+  for (i = 0; i < 100; i++) xprintf(xout_dbuf, &db, "%lu,", (unsigned long) i);
+  assert(db.len == n && s_allocs == 4);  // 64, 128, 256, 512 bytes
+  p = xdbuf_done(&db);
+  assert(p != NULL && strcmp(p, expected) == 0 && db.buf == NULL);
+  heap(p, 0, 0, NULL);
+  xdbuf_init(&db, heap, NULL);
+  xprintfs(xouts_dbuf, &db, "%s%s", expected, expected);
+  assert(db.len == 2 * n && db.size == 2 * (n + 1));  // n + 1, then doubled
+  xdbuf_free(&db);
+  assert(db.buf == NULL && db.len == 0);
+  xdbuf_init(&db, heap, NULL);
+  p = xdbuf_done(&db);  // Nothing printed: an empty string
+  assert(p != NULL && *p == '\0');
+  heap(p, 0, 0, NULL);
+
+  // Arena: the last allocation grows in place, without copying
+  xdbuf_init(&db, xarena_alloc, &arena);
+  xprintf(xout_dbuf, &db, "%.*s", 130, expected);
+  q = db.buf;
+  xprintf(xout_dbuf, &db, "%.*s", 100, expected + 130);
+  assert(db.buf == q && db.size == 231);  // 262 bytes do not fit, 231 do
+  p = xdbuf_done(&db);
+  assert(p == q && strlen(p) == 230 && memcmp(p, expected, 230) == 0);
+  xdbuf_init(&db, xarena_alloc, &arena);
+  xprintf(xout_dbuf, &db, "%.*s", 30, expected);
+  assert(db.buf == NULL && db.len == 30);  // Out of memory
+  xprintf(xout_dbuf, &db, "%s", "hi");
+  assert(xdbuf_done(&db) == NULL);
+
+  arena.len = 0;  // Reset the arena
+  xdbuf_init(&db, xarena_alloc, &arena);
+  xprintf(xout_dbuf, &db, "%s", "hi");
+  assert(xarena_alloc(NULL, 0, 10, &arena) == mem + 64);
+  xprintf(xout_dbuf, &db, "%.*s", 100, expected);  // Moves the buffer
+  p = xdbuf_done(&db);
+  assert(p == mem + 80 && strlen(p) == 102 && memcmp(p, "hi0,1,", 6) == 0);
+}
+
+static void test_xlog(void) {
+  static char mem[400];
+  char buf[400], exp[400], str[] = "abcdefghijklmnopqrstuvwxyz";
+  uint8_t ip4[4] = {127, 0, 0, 1};
+  struct xbuf out = {buf, sizeof(buf), 0};
+  struct xlog log;
+  size_t i, n = 0, m = 0;
+
+  // Records render exactly like xprintf
+  xlog_init(&log, mem, sizeof(mem) + 5, 0);
+  assert(log.size == sizeof(mem));
+#define XLOG_TEST(...)                                            \
+  assert(xlog_printf(&log, __VA_ARGS__));                         \
+  n += xsnprintf(exp + n, sizeof(exp) - n, __VA_ARGS__)
+  XLOG_TEST("%d %u %x|%5s|%-3s|%c", -1, 3000000000U, 255, "ab", "c", 'z');
+  XLOG_TEST("%lld %ld %#04x %lu|%.*s|%%%y", -((int64_t) 1 << 40), -7L, 10,
+            123456789UL, 3, "abcdef");
+  XLOG_TEST("%g %.3f %.*g|%-6.2s|", 1.5, 3.14159, 2, 2.71828, "xyz");
+  XLOG_TEST("%m %M|%p", XESC("a\"b"), fmt_ip4, ip4, (void *) buf);
+#undef XLOG_TEST
+  assert(xlog_flush(&log, xout_buf, &out) == n && out.len == n);
+  assert(memcmp(buf, exp, n) == 0 && log.head == log.tail);
+  assert(xlog_flush(&log, xout_buf, &out) == 0);
+
+  // Strings and %M are copied, unless the flags say otherwise
+  assert(xlog_printf(&log, "%s %M,", str, fmt_ip4, ip4));
+  str[0] = 'X', ip4[3] = 2;
+  out.len = 0, xlog_flush(&log, xout_buf, &out);
+  assert(out.len == 37 && memcmp(buf, "abcdefghijklmnopqrstuvwxyz 127.0.0.1,",
+                                 37) == 0);
+  xlog_init(&log, mem, sizeof(mem), XLOG_REF_STR | XLOG_REF_FMT);
+  assert(xlog_printf(&log, "%.3s %m", str, fmt_ip4, ip4));
+  str[1] = 'Y', ip4[3] = 3;
+  out.len = 0, xlog_flush(&log, xout_buf, &out);
+  assert(out.len == 15 && memcmp(buf, "XYc \"127.0.0.3\"", 15) == 0);
+
+  // A full ring drops records, and wraps around once drained
+  xlog_init(&log, mem, sizeof(mem), 0);
+  for (i = n = 0; xlog_printf(&log, "%d,", (int) i); i++) {
+    n += xsnprintf(exp + n, sizeof(exp) - n, "%d,", (int) i);
+  }
+  assert(i > 10 && log.dropped == 1);
+  out.len = 0, xlog_flush(&log, xout_buf, &out);
+  assert(out.len == n && memcmp(buf, exp, n) == 0);
+  for (i = n = 0; i < 500; i++) {
+    if (xlog_printf(&log, "%u:%.*s,", (unsigned) i, (int) (i % 27), str)) {
+      n += xsnprintf(exp + n, sizeof(exp) - n, "%u:%.*s,", (unsigned) i,
+                     (int) (i % 27), str);
+    }
+    if (i % 7 == 6) {
+      out.len = 0, m += xlog_flush(&log, xout_buf, &out);
+      assert(out.len == n && memcmp(buf, exp, n) == 0);
+      n = 0;
+    }
+  }
+  assert(m > 2000 && log.dropped > 1);
+  // The largest record: header, precision, string, NUL, and 8 bytes free
+  n = sizeof(mem) - sizeof(size_t) - sizeof(char *) - sizeof(int) - 1 - 8;
+  memset(exp, 'x', sizeof(exp));
+  xlog_init(&log, mem, sizeof(mem), 0);
+  assert(!xlog_printf(&log, "%.*s", (int) n + 1, exp) && log.dropped == 1);
+  assert(xlog_printf(&log, "%.*s", (int) n, exp));
+  out.len = 0, xlog_flush(&log, xout_buf, &out);
+  assert(out.len == n && buf[n - 1] == 'x');
+}
+
+static char s_out[300];
+static size_t s_outlen, s_limit = ~(size_t) 0;  // Output, max bytes per call
+static size_t s_calls;                          // Number of calls to batch()
+
+static size_t batch(const struct xstr *v, size_t n, void *param) {
+  size_t i, k, total = 0;
+  (void) param, s_calls++;
+  for (i = 0; i < n && total < s_limit; i++) {
+    k = v[i].len < s_limit - total ? v[i].len : s_limit - total;
+    memcpy(s_out + s_outlen, v[i].buf, k), s_outlen += k, total += k;
+  }
+  return total;
+}
+
+static void test_sink(void) {
+  char mem1[16], mem2[64], exp[300];
+  struct xflush fl;
+  struct xsink a, b;
+  unsigned long t = 1000;
+  size_t i, n;
+
+  xflush_init(&fl, batch, NULL, 10, 100);  // 10 bytes, or 100 ticks
+  xsink_init(&a, &fl, mem1, sizeof(mem1) + 3);
+  xsink_init(&b, &fl, mem2, sizeof(mem2));
+  assert(a.size == 16 && fl.sinks == &b && b.next == &a);
+
+  // Whole lines from all sinks are written in one batch
+  xprintf(xout_sink, &a, "a%d\n", 1);
+  xprintf(xout_sink, &a, "a%d", 2);  // Unfinished line
+  xprintfs(xouts_sink, &b, "b%d\nb%d\n", 1, 2);
+  assert(xflush_poll(&fl, 50) == 0);  // 9 bytes pending, deadline not reached
+  assert(xflush_poll(&fl, 100) == 9 && s_calls == 1);
+  assert(s_outlen == 9 && memcmp(s_out, "b1\nb2\na1\n", 9) == 0);
+  xprintf(xout_sink, &a, "%s\n", "!");
+  xprintf(xout_sink, &b, "%s\n", "b3, more");
+  assert(xflush_poll(&fl, 101) == 13 && s_calls == 2);  // 10 bytes reached
+  assert(s_outlen == 22 && memcmp(s_out + 9, "b3, more\na2!\n", 13) == 0);
+
+  // Ring buffer wraps around
+  for (i = n = 0, s_outlen = 0; i < 30; i++, t += 100) {
+    xprintf(xout_sink, &a, "line %d\n", (int) i);
+    n += xsnprintf(exp + n, sizeof(exp) - n, "line %d\n", (int) i);
+    if (i % 2) xflush_poll(&fl, t);
+  }
+  assert(s_outlen == n && memcmp(s_out, exp, n) == 0 && a.dropped == 0);
+
+  // A line that does not fit is dropped, with the unfinished part before it
+  xprintf(xout_sink, &a, "%s", "part ");
+  xprintf(xout_sink, &a, "%s\n", "of a line longer than 16 bytes");
+  xprintfs(xouts_sink, &a, "%s\n", "another line longer than 16 bytes");
+  xprintf(xout_sink, &a, "%s\n", "ok");
+  s_outlen = 0, xflush_poll(&fl, t += 100);
+  assert(s_outlen == 3 && memcmp(s_out, "ok\n", 3) == 0 && a.dropped == 2);
+
+  // Short writes are retried, unfinished lines are handed over on commit
+  s_limit = 5, s_outlen = 0;
+  xprintf(xout_sink, &b, "%s\n", "12345678");
+  assert(xflush_poll(&fl, t += 100) == 5 && xflush_poll(&fl, t += 100) == 4);
+  s_limit = ~(size_t) 0;
+  xprintf(xout_sink, &b, "%s", "prompt> ");
+  assert(xflush_poll(&fl, t += 100) == 0);
+  xsink_commit(&b);
+  assert(xflush_poll(&fl, t += 100) == 8);
+  assert(s_outlen == 17 && memcmp(s_out, "12345678\nprompt> ", 17) == 0);
+
+  // More sinks than fit into one batch: all are written, and after a short
+  // write the next call continues where the previous one stopped
+  {
+    static char mem[XFLUSH_IOV + 4][8];
+    static struct xsink sinks[XFLUSH_IOV + 4];
+    int j, ns = (int) (sizeof(sinks) / sizeof(sinks[0]));
+    xflush_init(&fl, batch, NULL, 0, 0);
+    for (j = 0; j < ns; j++) xsink_init(&sinks[j], &fl, mem[j], sizeof(mem[j]));
+    for (n = 0, j = ns - 1; j >= 0; j--) {  // Newest sink is the first one
+      n += xsnprintf(exp + n, sizeof(exp) - n, "s%02d\n", j);
+    }
+    for (j = 0; j < ns; j++) xprintf(xout_sink, &sinks[j], "s%02d\n", j);
+    s_outlen = s_calls = 0;
+    assert(xflush_poll(&fl, t) == n && s_calls == 2);
+    assert(s_outlen == n && memcmp(s_out, exp, n) == 0);
+    for (j = 0; j < ns; j++) xprintf(xout_sink, &sinks[j], "s%02d\n", j);
+    for (s_limit = 8, s_outlen = 0, j = 0; j < ns / 2; j++) {
+      assert(xflush_poll(&fl, t) == 8);  // Two lines per call
+    }
+    assert(s_outlen == n && memcmp(s_out, exp, n) == 0);
+    s_limit = ~(size_t) 0;
+  }
+
+  // Closed sinks are removed once their data is written out
+  {
+    struct xsink c;
+    xflush_init(&fl, batch, NULL, 0, 0);
+    xsink_init(&a, &fl, mem1, sizeof(mem1));
+    xsink_init(&b, &fl, mem2, sizeof(mem2));
+    xsink_init(&c, &fl, exp, sizeof(exp));
+    xprintf(xout_sink, &b, "%s", "b1");  // Unfinished line is handed over
+    assert(!xsink_close(&b) && fl.sinks == &c);
+    s_outlen = 0;
+    assert(xflush_poll(&fl, t) == 2 && !xsink_close(&b));
+    assert(xflush_poll(&fl, t) == 0 && xsink_close(&b));
+    assert(fl.sinks == &c && c.next == &a && a.next == NULL);
+    assert(!xsink_close(&c));  // Nothing left to write
+    assert(xflush_poll(&fl, t) == 0);
+    assert(xsink_close(&c) && fl.sinks == &a);
+    xprintf(xout_sink, &a, "%s\n", "a1");
+    assert(xflush_poll(&fl, t) == 3 && s_outlen == 5);
+    assert(memcmp(s_out, "b1a1\n", 5) == 0);
+    assert(xsink_close(&a) == false);
+    assert(xflush_poll(&fl, t) == 0 && xsink_close(&a) && fl.sinks == NULL);
+  }
+
+#if defined(STR_POSIX)
+  {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    xflush_init(&fl, xflush_writev, &fds[1], 0, 0);
+    xsink_init(&a, &fl, mem1, sizeof(mem1));
+    xsink_init(&b, &fl, mem2, sizeof(mem2));
+    xprintf(xout_sink, &a, "%s\n", "0123456789"), xflush_poll(&fl, 0);
+    xprintf(xout_sink, &a, "%s\n", "abcdefghij");  // Wraps around
+    xprintf(xout_sink, &b, "%s=%d\n", "b", 1);
+    assert(xflush_poll(&fl, 0) == 15);
+    assert(read(fds[0], exp, sizeof(exp)) == 26);
+    assert(memcmp(exp, "0123456789\nb=1\nabcdefghij\n", 26) == 0);
+    close(fds[0]), close(fds[1]);
+  }
+#endif
+}
+
+static size_t s_room;  // Number of bytes tx() accepts
+
+static size_t tx(const char *buf, size_t len, void *param) {
+  struct xbuf *b = (struct xbuf *) param;
+  size_t n = len < s_room ? len : s_room;
+  memcpy(b->buf + b->len, buf, n), b->len += n, s_room -= n;
+  return n;
+}
+
+static void test_xprint(void) {
+  char args[256], out[300], exp[300], s[] = "body";
+  uint8_t ip4[4] = {10, 0, 0, 1}, mac[6] = {1, 2, 3, 4, 5, 6};
+  struct xbuf b = {out, sizeof(out), 0};
+  struct xprint pr, pr2;
+  size_t k, n, calls;
+  unsigned flags;
+#define XPRINT_FMT                                                \
+  "HTTP/1.1 %d %s\r\nContent-Length: %5u\r\n\r\n%m|%M|%-8s|%.*s|" \
+  "%.9s|%c%%|%g|%lld|%#x|%y"
+#define XPRINT_ARGS                                                 \
+  200, "OK", 1234U, fmt_ip4, ip4, fmt_mac, mac, s, 3, "abcdef", "xy", \
+      'z', 2.5, (int64_t) 1 << 40, 255
+  n = xsnprintf(exp, sizeof(exp), XPRINT_FMT, XPRINT_ARGS);
+  for (flags = 0; flags < 4; flags++) {
+    for (k = 1; k < 20; k++) {
+      assert(xprint_start(&pr, args, sizeof(args), flags, XPRINT_FMT,
+                          XPRINT_ARGS));
+      for (b.len = calls = 0; s_room = k, !xprint_resume(&pr, tx, &b);) {
+        calls++;
+      }
+      assert(b.len == n && memcmp(out, exp, n) == 0);
+      assert(calls == (n + k - 1) / k - 1);  // Every call fills the sink
+      assert(xprint_resume(&pr, tx, &b) && b.len == n);
+    }
+  }
+#undef XPRINT_FMT
+#undef XPRINT_ARGS
+
+  // Arguments are captured: copied by default, referenced if asked to
+  k = sizeof(size_t) + 2 * sizeof(char *);  // Header and a string pointer
+  assert(xprint_start(&pr, args, k + 8, 0, "%s", s));
+  assert(xprint_start(&pr2, exp, k, XLOG_REF_STR, "%s", s));
+  s[0] = 'B', s_room = 10, b.len = 0;
+  assert(xprint_resume(&pr, tx, &b) && xprint_resume(&pr2, tx, &b));
+  assert(b.len == 8 && memcmp(out, "bodyBody", 8) == 0);
+  assert(!xprint_start(&pr, args, k, 0, "%s", "does not fit"));
+}
+
+#if defined(__cplusplus) && __cplusplus >= 201703L
+// Compare str::xsnprintf() with xsnprintf(), given the same arguments
+#define CPP_EQ(fmt, ...)                                        \
+  (str::xsnprintf(a, sizeof(a), XFMT(fmt), __VA_ARGS__) ==      \
+       xsnprintf(b, sizeof(b), fmt, __VA_ARGS__) &&             \
+   strcmp(a, b) == 0)
+
+static void test_cpp(void) {
+  char a[100], b[100], s[] = "body";
+  const char *null = NULL;
+  uint8_t ip4[4] = {10, 0, 0, 1};
+  std::string str("a\0b", 3);
+  std::string_view sv("abcdef", 4);
+  struct xbuf mb = {a, sizeof(a), 0};
+  assert(CPP_EQ("%d %d %d|%u|%x|%X", 0, -1, 123456, 42U, 255, 0xabc));
+  assert(CPP_EQ("%lld %llu %llx", -((int64_t) 1 << 40), (uint64_t) ~0ULL,
+                (uint64_t) 1 << 63));
+  assert(CPP_EQ("%ld %lu %lx", -7L, 7UL, 0xfeedUL));
+  assert(CPP_EQ("%5d|%-5d|%05d|%#x|%#06x|%#-6x|", 12, 12, -12, 255, 255, 7));
+  assert(CPP_EQ("%u %x %d", (unsigned) -1, -1, (int) (char) 'z'));
+  assert(CPP_EQ("%s|%5s|%-5s|%.2s|%.*s|%.9s|%5.2s", s, s, s, s, 3, "abcdef",
+                "xy", "abc"));
+  assert(CPP_EQ("%s|%5s|%-3s|", null, null, null));
+  assert(CPP_EQ("%c%c %% %%", 'a', 'b'));
+  assert(CPP_EQ("%g %g %f %.3f %10.2f %-10g|", 1.5, -0.1, 3.25, 2.0 / 3,
+                1e3, 1e-5));
+  assert(CPP_EQ("%f|%.*f", 1e40, 40, 0.1));  // Longer than 40 characters
+  assert(CPP_EQ("%-50.45g|", 0.1) && CPP_EQ("%f", 1e300));
+  assert(CPP_EQ("%p %p", (void *) s, (void *) NULL));
+
+  // Types unknown to the C version
+  assert(str::xsnprintf(a, sizeof(a), XFMT("%s|%5s|%.2s|%-6s|"), sv, sv, sv,
+                        str) == 21);
+  assert(memcmp(a, "abcd| abcd|ab|a\0b   |", 21) == 0);
+  str::xsnprintf(a, sizeof(a), XFMT("%d %u %c %g %.1f"), (short) -2,
+                 (uint8_t) 200, 65, 3, 1.75f);
+  xsnprintf(b, sizeof(b), "%d %u %c %g %.1f", -2, 200, 'A', 3.0, 1.75);
+  assert(strcmp(a, b) == 0 && strcmp(a, "-2 200 A 3 1.8") == 0);
+  assert(str::xsnprintf(a, sizeof(a), XFMT("%M|%m"), str::fn(fmt_ip4, ip4),
+                        str::fn(fmt_esc, 0, "a\"b")) == 15);
+  xsnprintf(b, sizeof(b), "%M|%m", fmt_ip4, ip4, XESC("a\"b"));
+  assert(strcmp(a, b) == 0 && strcmp(a, "10.0.0.1|\"a\\\"b\"") == 0);
+
+  // Truncation, and an empty format
+  assert(str::xsnprintf(a, 5, XFMT("%s=%d"), "abc", 1234) == 8);
+  assert(strcmp(a, "abc=") == 0);
+  assert(str::xsnprintf(a, 0, XFMT("%d"), 1) == 1);
+  assert(str::xsnprintf(a, sizeof(a), XFMT("")) == 0 && a[0] == '\0');
+
+  // Printing to a function
+  assert(str::xprintf(xout_buf, &mb, XFMT("%d %s %M"), 1, "x",
+                      str::fn(fmt_ip4, ip4)) == 12);
+  assert(mb.len == 12 && memcmp(a, "1 x 10.0.0.1", 12) == 0);
+}
+#undef CPP_EQ
+#endif
+
 static void test_xmatch(void) {
   struct xstr caps[3];
   assert(xmatch(xstr_n("", 0), xstr_n("", 0), NULL) == true);
@@ -225,15 +1142,167 @@ static void test_xmatch(void) {
   assert(xmatch(xstr_s("//a.c"), xstr_s("#.c"), caps) == true);
   assert(xmatch(xstr_s("a_b_c_"), xstr_s("a*b*c"), caps) == false);
   assert(xmatch(xstr_s("a__b_c"), xstr_s("a*b*c"), caps) == true);
+  assert(caps[0].len == 2 && caps[1].len == 1 && caps[1].buf[0] == '_');
+
+  // `?` after a wildcard, with backtracking
+  assert(xmatch(xstr_s("abx"), xstr_s("a*?"), caps) == true);
+  assert(caps[0].len == 1 && caps[0].buf[0] == 'b');
+  assert(caps[1].len == 1 && caps[1].buf[0] == 'x');
+  assert(xmatch(xstr_s("ab/cd"), xstr_s("#?d"), caps) == true);
+  assert(caps[0].len == 3 && memcmp(caps[0].buf, "ab/", 3) == 0);
+  assert(caps[1].len == 1 && caps[1].buf[0] == 'c');
+  assert(xmatch(xstr_s("ab/cd"), xstr_s("*?d"), caps) == false);
+  assert(xmatch(xstr_s("x/y/a"), xstr_s("*/a"), caps) == false);
+  assert(xmatch(xstr_s("/foo/bar/baz"), xstr_s("/*/baz"), NULL) == false);
+  assert(xmatch(xstr_s("/foo/bar/baz"), xstr_s("/#/baz"), NULL) == true);
+  {
+    // Many retries must not run past the end of caps
+    static char s[1000];
+    struct xstr c[4];
+    memset(s, 'a', sizeof(s));
+    assert(xmatch(xstr_n(s, sizeof(s)), xstr_s("*??b"), c) == false);
+    assert(xmatch(xstr_n(s, sizeof(s)), xstr_s("#a#a#a#a#a#b"), NULL) == false);
+    s[sizeof(s) - 1] = 'b';
+    assert(xmatch(xstr_n(s, sizeof(s)), xstr_s("*??b"), c) == true);
+    assert(c[0].len == sizeof(s) - 3 && c[2].buf == &s[sizeof(s) - 2]);
+  }
+}
+
+static void test_xroutes(void) {
+  static const char *patterns[] = {"/api/v1/users/*", "/api/v1/users/*/posts",
+                                   "/api/v1/#",       "/static/#.css",
+                                   "/api/v?/ping",    "/",
+                                   "#"};
+  struct xroute routes[8];
+  struct xroute_node nodes[40];
+  struct xroutes rs;
+  struct xstr caps[3];
+  size_t i;
+  xroutes_init(&rs, routes, 8, nodes, 40);
+  for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+    assert(xroutes_add(&rs, xstr_s(patterns[i])) == (int) i);
+  }
+  assert(xroutes_match(&rs, xstr_s("/api/v1/users/joe"), caps) == 0);
+  assert(caps[0].len == 3 && memcmp(caps[0].buf, "joe", 3) == 0);
+  assert(xroutes_match(&rs, xstr_s("/api/v1/users/joe/posts"), caps) == 1);
+  assert(caps[0].len == 3 && memcmp(caps[0].buf, "joe", 3) == 0);
+  assert(xroutes_match(&rs, xstr_s("/api/v1/users/joe/x"), caps) == 2);
+  assert(caps[0].len == 11 && memcmp(caps[0].buf, "users/joe/x", 11) == 0);
+  assert(xroutes_match(&rs, xstr_s("/static/a/b.css"), NULL) == 3);
+  assert(xroutes_match(&rs, xstr_s("/api/v2/ping"), caps) == 4);
+  assert(caps[0].len == 1 && caps[0].buf[0] == '2');
+  assert(xroutes_match(&rs, xstr_s("/"), NULL) == 5);
+  assert(xroutes_match(&rs, xstr_s("/static/a.js"), NULL) == 6);
+  assert(xroutes_match(&rs, xstr_s(""), NULL) == 6);
+
+  // Results are the same as trying patterns with xmatch() one by one
+  xroutes_init(&rs, routes, 8, nodes, 40);
+  assert(xroutes_add(&rs, xstr_s("/a/*")) == 0);
+  assert(xroutes_add(&rs, xstr_s("/a/b")) == 1);
+  assert(xroutes_add(&rs, xstr_s("/a")) == 2);
+  assert(xroutes_match(&rs, xstr_s("/a/b"), NULL) == 0);
+  assert(xroutes_match(&rs, xstr_s("/a"), NULL) == 2);
+  assert(xroutes_match(&rs, xstr_s("/a/b/c"), NULL) == -1);
+  assert(xroutes_match(&rs, xstr_s("/b"), NULL) == -1);
+
+  // Out of space
+  xroutes_init(&rs, routes, 1, nodes, 40);
+  assert(xroutes_add(&rs, xstr_s("/a")) == 0);
+  assert(xroutes_add(&rs, xstr_s("/b")) == -1);
+  xroutes_init(&rs, routes, 8, nodes, 3);
+  assert(xroutes_add(&rs, xstr_s("/a*")) == 0);
+  assert(xroutes_add(&rs, xstr_s("/ab")) == -1);
+  assert(xroutes_match(&rs, xstr_s("/abc"), NULL) == 0);
+  xroutes_init(&rs, routes, 8, nodes, 4);
+  assert(xroutes_add(&rs, xstr_s("/a*")) == 0 && rs.nnodes == 3);
+  assert(xroutes_add(&rs, xstr_s("/bcd")) == -1 && rs.nnodes == 3);
+  assert(xroutes_add(&rs, xstr_s("/b")) == 1 && rs.nnodes == 4);
+  assert(xroutes_match(&rs, xstr_s("/b"), NULL) == 1);
+  assert(xroutes_match(&rs, xstr_s("/bcd"), NULL) == -1);
+}
+
+static int has_id(const int *ids, int n, int id) {
+  while (n-- > 0) {
+    if (ids[n] == id) return 1;
+  }
+  return 0;
+}
+
+static void test_xtopics(void) {
+  struct xtopic_node nodes[20];
+  struct xtopic_sub subs[10];
+  struct xtopics t;
+  int ids[10], n;
+  xtopics_init(&t, nodes, 20, subs, 10);
+  assert(xtopics_add(&t, xstr_s("dev/*/temp"), 1) == 0);
+  assert(xtopics_add(&t, xstr_s("dev/42/#"), 2) == 0);
+  assert(xtopics_add(&t, xstr_s("dev/42/temp"), 3) == 0);
+  assert(xtopics_add(&t, xstr_s("#"), 4) == 0);
+  assert(xtopics_add(&t, xstr_s("dev/42/temp"), 5) == 0);
+  assert(xtopics_add(&t, xstr_s("dev/4*/temp"), 6) == -1);  // Invalid filters
+  assert(xtopics_add(&t, xstr_s("dev/#/temp"), 6) == -1);
+  assert(xtopics_add(&t, xstr_s("dev/?"), 6) == -1);
+
+  n = xtopics_match(&t, xstr_s("dev/42/temp"), ids, 10);
+  assert(n == 5 && has_id(ids, n, 1) && has_id(ids, n, 2) &&
+         has_id(ids, n, 3) && has_id(ids, n, 4) && has_id(ids, n, 5));
+  n = xtopics_match(&t, xstr_s("dev/7/temp"), ids, 10);
+  assert(n == 2 && has_id(ids, n, 1) && has_id(ids, n, 4));
+  n = xtopics_match(&t, xstr_s("dev/42/a/b"), ids, 10);
+  assert(n == 2 && has_id(ids, n, 2) && has_id(ids, n, 4));
+  n = xtopics_match(&t, xstr_s("dev/42"), ids, 10);  // Same as xmatch()
+  assert(n == 1 && ids[0] == 4);
+  assert(xtopics_match(&t, xstr_s("dev/42/temp"), ids, 2) == 5);
+
+  // Remove subscriptions, nodes are freed when no longer used
+  assert(xtopics_del(&t, xstr_s("dev/42/temp"), 1) == -1);  // No such id
+  assert(xtopics_del(&t, xstr_s("dev/42/temp"), 3) == 0);
+  assert(xtopics_del(&t, xstr_s("dev/42/temp"), 3) == -1);
+  n = xtopics_match(&t, xstr_s("dev/42/temp"), ids, 10);
+  assert(n == 4 && !has_id(ids, n, 3) && has_id(ids, n, 5));
+  assert(xtopics_del(&t, xstr_s("dev/42/temp"), 5) == 0);
+  assert(xtopics_del(&t, xstr_s("dev/42/#"), 2) == 0);
+  assert(xtopics_del(&t, xstr_s("dev/*/temp"), 1) == 0);
+  assert(xtopics_del(&t, xstr_s("#"), 4) == 0);
+  assert(t.nfree == 19 && xtopics_match(&t, xstr_s("dev"), ids, 10) == 0);
+
+  // Out of space
+  xtopics_init(&t, nodes, 3, subs, 10);
+  assert(xtopics_add(&t, xstr_s("a/b"), 1) == 0);
+  assert(xtopics_add(&t, xstr_s("a/c"), 2) == -1);
+  assert(xtopics_add(&t, xstr_s("a/b"), 2) == 0);
+  xtopics_init(&t, nodes, 20, subs, 1);
+  assert(xtopics_add(&t, xstr_s("a/b"), 1) == 0);
+  assert(xtopics_add(&t, xstr_s("a/b"), 2) == -1);
 }
 
 int main(void) {
   test_std();
+  test_compiled();
   test_float();
   test_m();
+  test_span();
   test_json();
+  test_json_int();
+  test_json_many();
+  test_json_next();
+  test_json_xstr();
+  test_utf8();
+  test_json_index();
+  test_json_stream();
   test_base64();
+  test_base64_stream();
+  test_hexdump();
+  test_dbuf();
+  test_xlog();
+  test_sink();
+  test_xprint();
+#if defined(__cplusplus) && __cplusplus >= 201703L
+  test_cpp();
+#endif
   test_xmatch();
+  test_xroutes();
+  test_xtopics();
   printf("SUCCESS\n");
   return 0;
 }